@@ -24,7 +24,7 @@ function debs() {
     apt-get install -y cmake libprotobuf-dev \
       protobuf-compiler libboost-system-dev \
       libboost-program-options-dev lcov \
-      default-jdk libunwind-dev
+      default-jdk libunwind-dev liblz4-dev libzstd-dev
 }
 
 function rpms() {
@@ -69,7 +69,8 @@ function rpms() {
 
   $SUDO $yumdnf install -y cmake boost-devel \
     protobuf-devel protobuf-compiler java-devel lcov \
-    libatomic python-virtualenv libunwind-devel ${extra}
+    libatomic python-virtualenv libunwind-devel lz4-devel libzstd-devel \
+    ${extra}
 }
 
 source /etc/os-release
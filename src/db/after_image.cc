@@ -0,0 +1,278 @@
+#include "db/after_image.h"
+#include <iostream>
+#include <limits>
+#include "util/coding.h"
+
+namespace cruzdb {
+
+AfterImage::AfterImage(cruzdb_proto::AfterImage&& after_image) :
+  flat_(false),
+  intention_(after_image.intention()),
+  num_nodes_(after_image.tree_size()),
+  header_size_(0),
+  proto_(std::move(after_image))
+{
+  if (proto_.has_prev_intention()) {
+    prev_intention_ = proto_.prev_intention();
+  }
+  byte_size_ = proto_.ByteSizeLong();
+}
+
+AfterImage::AfterImage(std::string&& flat) :
+  flat_(true),
+  flat_data_(std::move(flat))
+{
+  byte_size_ = flat_data_.size();
+
+  bool valid = flat_data_.size() >= kFlatHeaderSizeV1 &&
+    DecodeFixed32(flat_data_.data()) == kFlatMagic;
+
+  if (valid) {
+    const auto version = DecodeFixed32(flat_data_.data() + 4);
+    if (version == kFlatVersion) {
+      header_size_ = kFlatHeaderSize;
+      valid = flat_data_.size() >= kFlatHeaderSize;
+      if (valid) {
+        prev_intention_ = DecodeFixed64(flat_data_.data() + 24);
+      }
+    } else if (version == 1) {
+      header_size_ = kFlatHeaderSizeV1;
+    } else {
+      valid = false;
+    }
+  }
+
+  uint64_t payload_size = 0;
+  if (valid) {
+    intention_ = DecodeFixed64(flat_data_.data() + 8);
+    const uint64_t num_nodes = DecodeFixed32(flat_data_.data() + 16);
+    payload_size = DecodeFixed32(flat_data_.data() + 20);
+    valid = num_nodes <= (uint64_t)std::numeric_limits<int>::max() &&
+      flat_data_.size() ==
+        header_size_ + num_nodes * kFlatNodeSize + payload_size;
+    num_nodes_ = num_nodes;
+  }
+
+  // the node table is fixed-width, so this only checks the bounds of each
+  // entry's payload rather than decoding anything.
+  for (int idx = 0; valid && idx < num_nodes_; idx++) {
+    const char *node = flat_node(idx);
+    const uint64_t end = (uint64_t)DecodeFixed32(node + 16) +
+      DecodeFixed32(node + 20) + DecodeFixed32(node + 24);
+    valid = end <= payload_size;
+  }
+
+  if (!valid) {
+    std::cerr << "invalid flat after image" << std::endl;
+    assert(0);
+    exit(1);
+  }
+}
+
+void AfterImage::SerializeTo(std::string *dst) const
+{
+  if (flat_) {
+    dst->assign(flat_data_);
+    return;
+  }
+
+  if (!proto_.SerializeToString(dst)) {
+    std::cerr << "failed to serialize after image" << std::endl;
+    assert(0);
+    exit(1);
+  }
+}
+
+const char *AfterImage::flat_payload(int index) const
+{
+  return flat_data_.data() + header_size_ + num_nodes_ * kFlatNodeSize +
+    DecodeFixed32(flat_node(index) + 16);
+}
+
+bool AfterImage::Red(int index) const
+{
+  if (flat_) {
+    return flat_node(index)[36] & 0x1;
+  }
+  return proto_.tree(index).red();
+}
+
+uint32_t AfterImage::KeyShared(int index) const
+{
+  if (flat_) {
+    return DecodeFixed32(flat_node(index) + 28);
+  }
+  return proto_.tree(index).shared();
+}
+
+zlog::Slice AfterImage::KeySuffix(int index) const
+{
+  if (flat_) {
+    return zlog::Slice(flat_payload(index),
+        DecodeFixed32(flat_node(index) + 20));
+  }
+  return proto_.tree(index).key();
+}
+
+zlog::Slice AfterImage::Val(int index) const
+{
+  if (flat_) {
+    const char *node = flat_node(index);
+    return zlog::Slice(flat_payload(index) + DecodeFixed32(node + 20),
+        DecodeFixed32(node + 24));
+  }
+  return proto_.tree(index).val();
+}
+
+AfterImage::Pointer AfterImage::Left(int index) const
+{
+  if (flat_) {
+    const char *node = flat_node(index);
+    return Pointer{
+      static_cast<Pointer::Type>((node[36] >> 1) & 0x3),
+      DecodeFixed64(node),
+      DecodeFixed16(node + 32)};
+  }
+  return proto_pointer(proto_.tree(index).left());
+}
+
+AfterImage::Pointer AfterImage::Right(int index) const
+{
+  if (flat_) {
+    const char *node = flat_node(index);
+    return Pointer{
+      static_cast<Pointer::Type>((node[36] >> 3) & 0x3),
+      DecodeFixed64(node + 8),
+      DecodeFixed16(node + 34)};
+  }
+  return proto_pointer(proto_.tree(index).right());
+}
+
+AfterImage::Pointer AfterImage::proto_pointer(
+    const cruzdb_proto::NodePtr& ptr)
+{
+  if (ptr.nil()) {
+    return Pointer{Pointer::NIL, 0, 0};
+  }
+
+  const uint16_t offset = ptr.off();
+  if (ptr.self()) {
+    return Pointer{Pointer::SELF, 0, offset};
+  } else if (ptr.has_afterimage()) {
+    assert(!ptr.has_intention());
+    return Pointer{Pointer::AFTERIMAGE, ptr.afterimage(), offset};
+  } else {
+    assert(ptr.has_intention());
+    return Pointer{Pointer::INTENTION, ptr.intention(), offset};
+  }
+}
+
+AfterImageBuilder::AfterImageBuilder(bool flat) :
+  flat_(flat),
+  intention_(0),
+  prev_intention_(0),
+  num_nodes_(0)
+{
+}
+
+void AfterImageBuilder::Add(bool red, uint32_t shared,
+    const zlog::Slice& key_suffix, const zlog::Slice& val,
+    const AfterImage::Pointer& left, const AfterImage::Pointer& right)
+{
+  num_nodes_++;
+
+  if (!flat_) {
+    auto node = proto_.add_tree();
+    node->set_red(red);
+    if (shared > 0) {
+      node->set_shared(shared);
+    }
+    node->set_key(key_suffix.data(), key_suffix.size());
+    node->set_val(val.data(), val.size());
+    set_proto_pointer(node->mutable_left(), left);
+    set_proto_pointer(node->mutable_right(), right);
+    return;
+  }
+
+  const uint8_t flags = (red ? 0x1 : 0x0) |
+    (left.type << 1) | (right.type << 3);
+
+  PutFixed64(&table_, left.position);
+  PutFixed64(&table_, right.position);
+  PutFixed32(&table_, payload_.size());
+  PutFixed32(&table_, key_suffix.size());
+  PutFixed32(&table_, val.size());
+  PutFixed32(&table_, shared);
+  PutFixed16(&table_, left.offset);
+  PutFixed16(&table_, right.offset);
+  table_.push_back(flags);
+  table_.append(3, '\0');
+
+  payload_.append(key_suffix.data(), key_suffix.size());
+  payload_.append(val.data(), val.size());
+}
+
+void AfterImageBuilder::Finish(cruzdb_proto::LogEntry& entry)
+{
+  entry.set_type(cruzdb_proto::LogEntry::AFTER_IMAGE);
+
+  if (!flat_) {
+    proto_.set_intention(intention_);
+    proto_.set_prev_intention(prev_intention_);
+    entry.mutable_after_image()->Swap(&proto_);
+    return;
+  }
+
+  assert(payload_.size() <= std::numeric_limits<uint32_t>::max());
+  assert(table_.size() == num_nodes_ * AfterImage::kFlatNodeSize);
+
+  auto flat = entry.mutable_flat_after_image();
+  flat->clear();
+  flat->reserve(AfterImage::kFlatHeaderSize + table_.size() +
+      payload_.size());
+  PutFixed32(flat, AfterImage::kFlatMagic);
+  PutFixed32(flat, AfterImage::kFlatVersion);
+  PutFixed64(flat, intention_);
+  PutFixed32(flat, num_nodes_);
+  PutFixed32(flat, payload_.size());
+  PutFixed64(flat, prev_intention_);
+  flat->append(table_);
+  flat->append(payload_);
+}
+
+void AfterImageBuilder::set_proto_pointer(cruzdb_proto::NodePtr *dst,
+    const AfterImage::Pointer& src)
+{
+  switch (src.type) {
+    case AfterImage::Pointer::NIL:
+      dst->set_nil(true);
+      dst->set_self(false);
+      break;
+
+    case AfterImage::Pointer::SELF:
+      dst->set_nil(false);
+      dst->set_self(true);
+      dst->set_off(src.offset);
+      break;
+
+    case AfterImage::Pointer::AFTERIMAGE:
+      dst->set_nil(false);
+      dst->set_self(false);
+      dst->set_afterimage(src.position);
+      dst->set_off(src.offset);
+      break;
+
+    case AfterImage::Pointer::INTENTION:
+      dst->set_nil(false);
+      dst->set_self(false);
+      dst->set_intention(src.position);
+      dst->set_off(src.offset);
+      break;
+
+    default:
+      assert(0);
+      exit(1);
+  }
+}
+
+}
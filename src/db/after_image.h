@@ -0,0 +1,184 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <boost/optional.hpp>
+#include <zlog/slice.h>
+#include "db/cruzdb.pb.h"
+
+namespace cruzdb {
+
+/*
+ * An after image is the serialized set of nodes created by a transaction. It
+ * is stored in the log in one of two formats:
+ *
+ *   1. a cruzdb_proto::AfterImage message. This is the original format, and is
+ *   still read, and written when flat after images are disabled.
+ *
+ *   2. a flat binary format that is read in place. Accessing a node is a
+ *   constant time lookup into a fixed-width node table that holds the node's
+ *   color, child pointers, and the offsets of its key and value in a payload
+ *   region. All integers are little-endian.
+ *
+ *     header (32 bytes)
+ *       fixed32 magic
+ *       fixed32 version
+ *       fixed64 intention
+ *       fixed32 number of nodes
+ *       fixed32 payload size
+ *       fixed64 previous committed intention
+ *
+ *     node table (40 bytes per node)
+ *       fixed64 left child position
+ *       fixed64 right child position
+ *       fixed32 payload offset of the key suffix, which the value follows
+ *       fixed32 key suffix size
+ *       fixed32 value size
+ *       fixed32 shared key prefix size
+ *       fixed16 left child offset
+ *       fixed16 right child offset
+ *       byte    flags: bit 0 red, bits 1-2 left type, bits 3-4 right type
+ *       3 bytes reserved
+ *
+ *     payload
+ *
+ * Version 1 of the flat format has a 24 byte header without the previous
+ * committed intention, and is still read.
+ *
+ * In both formats keys are delta encoded against the previous node in the
+ * after image (see cruzdb_proto::Node).
+ */
+class AfterImage {
+ public:
+  // the physical location of a child node
+  struct Pointer {
+    enum Type : uint8_t {
+      NIL = 0,
+      SELF = 1,
+      AFTERIMAGE = 2,
+      INTENTION = 3
+    };
+
+    Type type;
+    uint64_t position;
+    uint16_t offset;
+  };
+
+  static const uint32_t kFlatMagic = 0x4941525a;
+  static const uint32_t kFlatVersion = 2;
+  static const size_t kFlatHeaderSize = 32;
+  static const size_t kFlatHeaderSizeV1 = 24;
+  static const size_t kFlatNodeSize = 40;
+
+  explicit AfterImage(cruzdb_proto::AfterImage&& after_image);
+
+  // it is a fatal error if the buffer is not a valid flat after image
+  explicit AfterImage(std::string&& flat);
+
+  AfterImage(const AfterImage& other) = delete;
+  AfterImage& operator=(const AfterImage& other) = delete;
+
+  // the intention that this after image was produced from
+  uint64_t Intention() const {
+    return intention_;
+  }
+
+  // the committed intention that preceded Intention(), zero if there was
+  // none, or boost::none if the after image predates commit backpointers.
+  boost::optional<uint64_t> PrevIntention() const {
+    return prev_intention_;
+  }
+
+  int NumNodes() const {
+    return num_nodes_;
+  }
+
+  bool IsFlat() const {
+    return flat_;
+  }
+
+  // the size of the after image in its stored format
+  size_t ByteSize() const {
+    return byte_size_;
+  }
+
+  // the after image in its stored format: the flat buffer, or the serialized
+  // protobuf message.
+  void SerializeTo(std::string *dst) const;
+
+  bool Red(int index) const;
+  uint32_t KeyShared(int index) const;
+  zlog::Slice KeySuffix(int index) const;
+  zlog::Slice Val(int index) const;
+  Pointer Left(int index) const;
+  Pointer Right(int index) const;
+
+ private:
+  const char *flat_node(int index) const {
+    assert(flat_);
+    assert(index >= 0 && index < num_nodes_);
+    return flat_data_.data() + header_size_ + index * kFlatNodeSize;
+  }
+
+  const char *flat_payload(int index) const;
+
+  static Pointer proto_pointer(const cruzdb_proto::NodePtr& ptr);
+
+  const bool flat_;
+  uint64_t intention_;
+  boost::optional<uint64_t> prev_intention_;
+  int num_nodes_;
+  size_t byte_size_;
+  size_t header_size_;
+
+  cruzdb_proto::AfterImage proto_;
+  const std::string flat_data_;
+};
+
+// accumulates the nodes of an after image and serializes them into a log entry
+// in either the flat or protobuf format.
+class AfterImageBuilder {
+ public:
+  explicit AfterImageBuilder(bool flat);
+
+  AfterImageBuilder(const AfterImageBuilder& other) = delete;
+  AfterImageBuilder& operator=(const AfterImageBuilder& other) = delete;
+
+  void Add(bool red, uint32_t shared, const zlog::Slice& key_suffix,
+      const zlog::Slice& val, const AfterImage::Pointer& left,
+      const AfterImage::Pointer& right);
+
+  void SetIntention(uint64_t intention) {
+    intention_ = intention;
+  }
+
+  uint64_t Intention() const {
+    return intention_;
+  }
+
+  void SetPrevIntention(uint64_t prev_intention) {
+    prev_intention_ = prev_intention;
+  }
+
+  int NumNodes() const {
+    return num_nodes_;
+  }
+
+  // move the serialized after image into a log entry
+  void Finish(cruzdb_proto::LogEntry& entry);
+
+ private:
+  static void set_proto_pointer(cruzdb_proto::NodePtr *dst,
+      const AfterImage::Pointer& src);
+
+  const bool flat_;
+  uint64_t intention_;
+  uint64_t prev_intention_;
+  int num_nodes_;
+
+  cruzdb_proto::AfterImage proto_;
+  std::string table_;
+  std::string payload_;
+};
+
+}
@@ -0,0 +1,291 @@
+#include "db/after_image_file_cache.h"
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include "util/coding.h"
+
+namespace cruzdb {
+
+namespace {
+
+const uint64_t kFileMagic = 0x3146434941435243ULL; // "CRCAICF1"
+const uint32_t kFileVersion = 3;
+
+// file header: fixed64 magic, fixed32 version, fixed32 unused, fixed64 size,
+// fixed64 log id, fixed64 write offset. files with an older version are
+// reinitialized.
+const size_t kFileHeaderSize = 40;
+
+// record header: fixed32 magic, fixed32 checksum, fixed64 position, fixed32
+// size, byte format, 3 bytes reserved. the checksum covers the log id and
+// everything in the record that follows it, so records left in the file by
+// another log are never valid. records are padded to 8 bytes.
+const uint32_t kRecordMagic = 0x43494152;
+const size_t kRecordHeaderSize = 24;
+
+enum RecordFormat : uint8_t {
+  kFlatRecord = 1,
+  kProtoRecord = 2
+};
+
+uint32_t checksum(uint64_t log_id, const char *data, size_t size)
+{
+  // fnv-1a
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 8; i++) {
+    hash ^= static_cast<uint8_t>(log_id >> (i * 8));
+    hash *= 16777619u;
+  }
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+size_t record_size(size_t data_size)
+{
+  return (kRecordHeaderSize + data_size + 7) & ~static_cast<size_t>(7);
+}
+
+}
+
+AfterImageFileCache::AfterImageFileCache(int fd, char *base, size_t size,
+    uint64_t log_id) :
+  fd_(fd),
+  base_(base),
+  size_(size),
+  log_id_(log_id),
+  write_offset_(kFileHeaderSize)
+{
+}
+
+AfterImageFileCache::~AfterImageFileCache()
+{
+  munmap(base_, size_);
+  close(fd_);
+}
+
+int AfterImageFileCache::Open(const std::string& path, size_t size,
+    uint64_t log_id, bool reset, std::unique_ptr<AfterImageFileCache> *cache)
+{
+  size &= ~static_cast<size_t>(7);
+  if (size <= kFileHeaderSize + kRecordHeaderSize) {
+    return -EINVAL;
+  }
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  // the file is written in place, so it can only be used by one instance
+  if (flock(fd, LOCK_EX | LOCK_NB)) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  bool init = reset;
+  if ((size_t)st.st_size != size) {
+    if (ftruncate(fd, 0) || ftruncate(fd, size)) {
+      int ret = -errno;
+      close(fd);
+      return ret;
+    }
+    init = true;
+  }
+
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  std::unique_ptr<AfterImageFileCache> c(
+      new AfterImageFileCache(fd, static_cast<char*>(base), size, log_id));
+
+  if (!init) {
+    init = DecodeFixed64(c->base_) != kFileMagic ||
+      DecodeFixed32(c->base_ + 8) != kFileVersion ||
+      DecodeFixed64(c->base_ + 16) != size ||
+      DecodeFixed64(c->base_ + 24) != log_id;
+  }
+
+  if (init) {
+    c->Init();
+  } else {
+    c->Recover();
+  }
+
+  *cache = std::move(c);
+
+  return 0;
+}
+
+void AfterImageFileCache::Init()
+{
+  memset(base_, 0, kFileHeaderSize + kRecordHeaderSize);
+  EncodeFixed64(base_, kFileMagic);
+  EncodeFixed32(base_ + 8, kFileVersion);
+  EncodeFixed64(base_ + 16, size_);
+  EncodeFixed64(base_ + 24, log_id_);
+  EncodeFixed64(base_ + 32, write_offset_);
+}
+
+void AfterImageFileCache::Recover()
+{
+  uint64_t offset = kFileHeaderSize;
+  while (offset + kRecordHeaderSize <= size_) {
+    const char *rec = base_ + offset;
+    if (DecodeFixed32(rec) != kRecordMagic) {
+      break;
+    }
+
+    const uint64_t pos = DecodeFixed64(rec + 8);
+    const uint32_t data_size = DecodeFixed32(rec + 16);
+    const uint8_t format = rec[20];
+    if (record_size(data_size) > size_ - offset ||
+        (format != kFlatRecord && format != kProtoRecord) ||
+        checksum(log_id_, rec + 8, kRecordHeaderSize - 8 + data_size) !=
+          DecodeFixed32(rec + 4)) {
+      break;
+    }
+
+    // a position that appears twice was re-inserted after being evicted
+    // from the index, so the later copy wins.
+    auto it = index_.find(pos);
+    if (it != index_.end()) {
+      offsets_.erase(it->second.offset);
+      index_.erase(it);
+    }
+
+    index_.emplace(pos, Record{offset, data_size, format == kFlatRecord});
+    offsets_.emplace(offset, pos);
+
+    offset += record_size(data_size);
+  }
+
+  // once the file has wrapped around, the scan continues past the newest
+  // records into older ones that haven't been overwritten yet. writing
+  // resumes after the newest record, where the last write ended. the scan
+  // passed through that point, unless the header is from before a crash.
+  const uint64_t persisted = DecodeFixed64(base_ + 32);
+  if (persisted >= kFileHeaderSize && persisted < offset &&
+      persisted % 8 == 0) {
+    write_offset_ = persisted;
+  } else {
+    write_offset_ = offset;
+  }
+}
+
+void AfterImageFileCache::evict(uint64_t begin, uint64_t end)
+{
+  auto it = offsets_.lower_bound(begin);
+  while (it != offsets_.end() && it->first < end) {
+    index_.erase(it->second);
+    it = offsets_.erase(it);
+  }
+}
+
+std::shared_ptr<AfterImage> AfterImageFileCache::Lookup(uint64_t pos)
+{
+  std::unique_lock<std::mutex> lk(lock_);
+
+  auto it = index_.find(pos);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+
+  // copy out of the mapping because the record may be overwritten once the
+  // lock is released.
+  const auto& record = it->second;
+  std::string data(base_ + record.offset + kRecordHeaderSize, record.size);
+  const bool flat = record.flat;
+
+  lk.unlock();
+
+  if (flat) {
+    return std::make_shared<AfterImage>(std::move(data));
+  }
+
+  cruzdb_proto::AfterImage after_image;
+  if (!after_image.ParseFromString(data)) {
+    return nullptr;
+  }
+
+  return std::make_shared<AfterImage>(std::move(after_image));
+}
+
+void AfterImageFileCache::Insert(uint64_t pos, const AfterImage& after_image)
+{
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    if (index_.find(pos) != index_.end()) {
+      return;
+    }
+  }
+
+  std::string data;
+  after_image.SerializeTo(&data);
+
+  const size_t rec_size = record_size(data.size());
+  if (rec_size > size_ - kFileHeaderSize) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lk(lock_);
+
+  if (index_.find(pos) != index_.end()) {
+    return;
+  }
+
+  // records left between the write offset and the end of the file remain
+  // valid until they are overwritten on the next pass.
+  if (write_offset_ + rec_size > size_) {
+    write_offset_ = kFileHeaderSize;
+  }
+
+  const uint64_t offset = write_offset_;
+  evict(offset, offset + rec_size);
+
+  char *rec = base_ + offset;
+  EncodeFixed64(rec + 8, pos);
+  EncodeFixed32(rec + 16, data.size());
+  rec[20] = after_image.IsFlat() ? kFlatRecord : kProtoRecord;
+  memset(rec + 21, 0, 3);
+  memcpy(rec + kRecordHeaderSize, data.data(), data.size());
+  memset(rec + kRecordHeaderSize + data.size(), 0,
+      rec_size - kRecordHeaderSize - data.size());
+  EncodeFixed32(rec + 4, checksum(log_id_, rec + 8,
+        kRecordHeaderSize - 8 + data.size()));
+  EncodeFixed32(rec, kRecordMagic);
+
+  write_offset_ = offset + rec_size;
+  EncodeFixed64(base_ + 32, write_offset_);
+
+  index_.emplace(pos, Record{offset, static_cast<uint32_t>(data.size()),
+      after_image.IsFlat()});
+  offsets_.emplace(offset, pos);
+}
+
+size_t AfterImageFileCache::NumEntries()
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  return index_.size();
+}
+
+}
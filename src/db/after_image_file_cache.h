@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "db/after_image.h"
+
+namespace cruzdb {
+
+/*
+ * A fixed-size memory mapped file that caches after images keyed by their
+ * position in the log. Unlike the in-memory caches its contents survive a
+ * restart, so cold reads of after images become page cache hits instead of
+ * log reads.
+ *
+ * The file is written as a circular sequence of checksummed records. When the
+ * write offset wraps around, the oldest records are overwritten. The write
+ * offset is kept in the file header. On open the index is rebuilt by scanning
+ * records from the start of the file until the first invalid record, and
+ * writing resumes at the saved offset. The file is locked while it is open, so
+ * only one instance can use it at a time. Since log positions are immutable, a cached after
+ * image never becomes stale as long as the cache file is used with a single
+ * log. the file header records an identifier of the log, and a file written
+ * for a different log is reinitialized when it is opened.
+ */
+class AfterImageFileCache {
+ public:
+  // open or create the cache file for the log identified by log_id. a file
+  // created with a different size or for a different log is reinitialized,
+  // as is any file when reset is true. returns 0 on success, or a negative
+  // errno, which is -EWOULDBLOCK if the file is in use.
+  static int Open(const std::string& path, size_t size, uint64_t log_id,
+      bool reset, std::unique_ptr<AfterImageFileCache> *cache);
+
+  ~AfterImageFileCache();
+
+  AfterImageFileCache(const AfterImageFileCache& other) = delete;
+  AfterImageFileCache& operator=(const AfterImageFileCache& other) = delete;
+
+  // returns nullptr if the after image is not cached
+  std::shared_ptr<AfterImage> Lookup(uint64_t pos);
+
+  void Insert(uint64_t pos, const AfterImage& after_image);
+
+  size_t NumEntries();
+
+ private:
+  AfterImageFileCache(int fd, char *base, size_t size, uint64_t log_id);
+
+  struct Record {
+    uint64_t offset;
+    uint32_t size;
+    bool flat;
+  };
+
+  void Init();
+  void Recover();
+  void evict(uint64_t begin, uint64_t end);
+
+  const int fd_;
+  char * const base_;
+  const size_t size_;
+  const uint64_t log_id_;
+
+  std::mutex lock_;
+  uint64_t write_offset_;
+  std::unordered_map<uint64_t, Record> index_;
+  // record offset -> log position
+  std::map<uint64_t, uint64_t> offsets_;
+};
+
+}
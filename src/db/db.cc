@@ -1,8 +1,11 @@
 #include "db_impl.h"
 #include <unistd.h>
 #include <sstream>
+#include <algorithm>
 #include <chrono>
 #include <iomanip>
+#include <random>
+#include <thread>
 #include <spdlog/spdlog.h>
 
 namespace cruzdb {
@@ -11,6 +14,38 @@ DB::~DB()
 {
 }
 
+int DB::Execute(const std::function<bool(Transaction*)>& fn,
+    const RetryPolicy& policy, const TransactionOptions& options)
+{
+  std::mt19937_64 engine{std::random_device{}()};
+  uint64_t backoff = policy.initial_backoff_us;
+
+  for (size_t attempt = 1;; attempt++) {
+    std::unique_ptr<Transaction> txn(BeginTransaction(options));
+    if (!txn) {
+      return -EINVAL;
+    }
+
+    if (!fn(txn.get())) {
+      return -ECANCELED;
+    }
+
+    if (txn->Commit()) {
+      return 0;
+    }
+
+    if (policy.max_attempts && attempt >= policy.max_attempts) {
+      return -EBUSY;
+    }
+
+    // a random delay spreads out transactions that conflicted with each
+    // other so they don't collide again on their next attempt.
+    std::uniform_int_distribution<uint64_t> delay(0, backoff);
+    std::this_thread::sleep_for(std::chrono::microseconds(delay(engine)));
+    backoff = std::min(backoff * 2, policy.max_backoff_us);
+  }
+}
+
 int DB::Open(const Options& options, zlog::Log *log,
     bool create_if_empty, DB **db)
 {
@@ -25,8 +60,9 @@ int DB::Open(const Options& options, zlog::Log *log,
       new EntryService(options, options.statistics.get(), log));
 
   uint64_t tail = entry_service->CheckTail();
-  if (tail == 0) {
-    if (!create_if_empty) {
+  const bool create = tail == 0;
+  if (create) {
+    if (!create_if_empty || options.follower) {
       return -EINVAL;
     }
 
@@ -35,11 +71,12 @@ int DB::Open(const Options& options, zlog::Log *log,
     entry_service->Fill(0);
 
     auto empty_tree = NodePtr(Node::Nil(), nullptr);
-    TransactionImpl txn(nullptr, empty_tree, 0, -1, 0);
+    // the random token makes the bootstrap intention unique to this log
+    const uint64_t token = std::mt19937_64(std::random_device{}())();
+    TransactionImpl txn(nullptr, empty_tree, 0, -1, token,
+        TransactionOptions());
 
-    std::stringstream key;
-    key << std::setw(20) << std::setfill('0') << 1;
-    txn.Put(PREFIX_COMMITTED_INTENTION, key.str(), "");
+    txn.Put(PREFIX_COMMITTED_INTENTION, DBImpl::CommittedIntentionKey(1), "");
 
     auto pos = entry_service->Append(std::move(txn.GetIntention()));
     assert(pos == 1);
@@ -47,25 +84,41 @@ int DB::Open(const Options& options, zlog::Log *log,
     auto tree = std::move(txn.Tree());
 
     std::vector<SharedNodeRef> delta;
-    cruzdb_proto::AfterImage after_image;
+    AfterImageBuilder after_image(options.flat_after_images);
     tree->SerializeAfterImage(after_image, 1, delta);
-    assert(after_image.intention() == 1);
+    assert(after_image.Intention() == 1);
 
     pos = entry_service->Append(after_image);
     assert(pos == 2);
   }
 
+  entry_service->OpenFileCache(options, create);
+
   DBImpl::RestorePoint point;
   uint64_t latest_intention;
   int ret = DBImpl::FindRestorePoint(entry_service.get(),
-      point, latest_intention);
+      point, latest_intention, !options.follower);
   assert(ret == 0);
 
+  // a follower starts serving reads at the restore point and catches up in
+  // the background as it finds newer after images.
+  if (!options.follower) {
+    DBImpl::FindRecoveryAfterImages(entry_service.get(),
+        options.recovery_threads, point);
+
+    if (!options.merge_operator &&
+        DBImpl::ReplaysMerges(entry_service.get(), point)) {
+      return -EINVAL;
+    }
+  }
+
   DBImpl *impl = new DBImpl(options, log, point,
       std::move(entry_service), logger);
 
   // if there is stuff to roll forward
-  impl->WaitOnIntention(latest_intention);
+  if (!options.follower) {
+    impl->WaitOnIntention(latest_intention);
+  }
 
   *db = impl;
 
@@ -4,6 +4,7 @@
 #include <iomanip>
 #include <boost/lexical_cast.hpp>
 #include <spdlog/spdlog.h>
+#include "util/coding.h"
 
 namespace cruzdb {
 
@@ -11,16 +12,19 @@ DBImpl::DBImpl(const Options& options, zlog::Log *log,
     const RestorePoint& point,
     std::unique_ptr<EntryService> entry_service,
     std::shared_ptr<spdlog::logger> logger) :
+  committed_intentions_(options.committed_intention_index_size),
+  processed_(point.after_image->Intention()),
   cache_(options, log, this),
   stop_(false),
   entry_service_(std::move(entry_service)),
   intention_iterator_(entry_service_->NewIntentionIterator(point.replay_start_pos)),
+  recovery_after_images_(point.after_images),
   in_flight_txn_rid_(-1),
-  root_(Node::Nil(), this),
 #if 0
   metrics_http_server_({"listening_ports", "0.0.0.0:8080", "num_threads", "1"}),
 #endif
   metrics_handler_(this),
+  transactions_started_(0),
   logger_(logger),
   options_(options),
   stats_(options.statistics.get())
@@ -28,17 +32,41 @@ DBImpl::DBImpl(const Options& options, zlog::Log *log,
   entry_service_->Start(point.replay_start_pos);
 
   auto root = cache_.CacheAfterImage(*point.after_image, point.after_image_pos);
-  root_ = root;
-
-  root_snapshot_ = point.after_image->intention();
-  last_intention_processed_ = root_snapshot_;
+  const auto root_snapshot = point.after_image->Intention();
+  PublishRoot(root, root_snapshot);
+
+  if (point.checkpoint) {
+    const auto& checkpoint = *point.checkpoint;
+    assert(checkpoint.intention() == root_snapshot);
+    // the checkpointed index is contiguous from its oldest position
+    committed_intentions_.init(checkpoint.committed_intentions_size() > 0 ?
+        checkpoint.committed_intentions(0) : root_snapshot);
+    for (const auto pos : checkpoint.committed_intentions()) {
+      committed_intentions_.push(pos);
+    }
+    committed_intentions_.finalize(root_snapshot);
+    assert(checkpoint.imap_intentions_size() ==
+        checkpoint.imap_after_images_size());
+    // mappings are stored most recently used first
+    for (int i = checkpoint.imap_intentions_size() - 1; i >= 0; i--) {
+      cache_.SetIntentionMapping(checkpoint.imap_intentions(i),
+          checkpoint.imap_after_images(i));
+    }
+  } else {
+    committed_intentions_.init(root_snapshot);
+  }
 
   if (logger_)
-    logger_->info("db init i_pos {} ai_pos {}", root_snapshot_, point.after_image_pos);
+    logger_->info("db init i_pos {} ai_pos {}", root_snapshot, point.after_image_pos);
 
-  transaction_processor_thread_ = std::thread(&DBImpl::TransactionProcessorEntry, this);
-  afterimage_writer_thread_ = std::thread(&DBImpl::AfterImageWriterEntry, this);
-  afterimage_finalizer_thread_ = std::thread(&DBImpl::AfterImageFinalizerEntry, this);
+  if (options_.follower) {
+    follower_thread_ = std::thread(&DBImpl::FollowerEntry, this,
+        point.replay_start_pos);
+  } else {
+    transaction_processor_thread_ = std::thread(&DBImpl::TransactionProcessorEntry, this);
+    afterimage_writer_thread_ = std::thread(&DBImpl::AfterImageWriterEntry, this);
+    afterimage_finalizer_thread_ = std::thread(&DBImpl::AfterImageFinalizerEntry, this);
+  }
 
   janitor_thread_ = std::thread(&DBImpl::JanitorEntry, this);
 
@@ -59,11 +87,18 @@ DBImpl::~DBImpl()
 
   entry_service_->Stop();
 
-  lcs_trees_cond_.notify_one();
+  {
+    std::lock_guard<std::mutex> lk(lcs_trees_lock_);
+    lcs_trees_cond_.notify_one();
+  }
 
-  transaction_processor_thread_.join();
-  afterimage_writer_thread_.join();
-  afterimage_finalizer_thread_.join();
+  if (options_.follower) {
+    follower_thread_.join();
+  } else {
+    transaction_processor_thread_.join();
+    afterimage_writer_thread_.join();
+    afterimage_finalizer_thread_.join();
+  }
 
   cache_.Stop();
 #if 0
@@ -72,14 +107,89 @@ DBImpl::~DBImpl()
 #endif
 }
 
+Snapshot *DBImpl::NewSnapshot(const RootVersion& version)
+{
+  auto snapshot = new Snapshot(this, version.root);
+  snapshots_.add(snapshot, version.snapshot);
+  return snapshot;
+}
+
 Snapshot *DBImpl::GetSnapshot()
 {
-  std::lock_guard<std::mutex> l(lock_);
-  return new Snapshot(this, root_);
+  return NewSnapshot(*LatestRoot());
+}
+
+Snapshot *DBImpl::GetSnapshotAt(uint64_t pos)
+{
+  // the root is published before the processed position, so the root read
+  // below is at least as new as every intention up to the processed position.
+  const auto processed = processed_.pos();
+  if (pos > processed) {
+    if (pos >= entry_service_->CheckTail()) {
+      return nullptr;
+    }
+
+    // entries after the processed position are usually after images. wait on
+    // any intention in the range before using the latest root. a follower
+    // only learns that an intention committed from its after image, and
+    // never hears about an intention that aborted, so it can't wait.
+    uint64_t intention_pos = 0;
+    for (auto p = processed + 1; p <= pos; p++) {
+      const auto entry = entry_service_->Read(p);
+      if (!entry) {
+        return nullptr;
+      }
+      if (entry->type == EntryService::CacheEntry::INTENTION) {
+        intention_pos = p;
+      }
+    }
+
+    if (intention_pos > 0) {
+      if (options_.follower) {
+        return nullptr;
+      }
+      WaitOnIntention(intention_pos);
+    }
+  }
+
+  const auto latest = LatestRoot();
+  if (pos >= latest->snapshot) {
+    return NewSnapshot(*latest);
+  }
+
+  auto intention = committed_intentions_.floor(pos);
+  if (!intention.second) {
+    intention.first = FindCommittedIntention(pos, intention.first);
+    if (intention.first == 0) {
+      return nullptr;
+    }
+  }
+
+  // the root of a tree is the last node in its after image. it isn't read
+  // here, and is fetched through the node cache when the snapshot is used.
+  const auto ai_pos = cache_.findAfterImagePosition(
+      NodeAddress(intention.first, 0, false));
+  const auto after_image = entry_service_->ReadAfterImage(ai_pos);
+  assert(after_image->Intention() == intention.first);
+
+  if (after_image->NumNodes() == 0) {
+    return NewSnapshot(RootVersion(NodePtr(Node::Nil(), this),
+          intention.first));
+  }
+
+  NodePtr root(nullptr, this);
+  root.SetAfterImageAddress(ai_pos, after_image->NumNodes() - 1);
+
+  if (logger_)
+    logger_->info("snapshot at {} i_pos {} ai_pos {}", pos,
+        intention.first, ai_pos);
+
+  return NewSnapshot(RootVersion(root, intention.first));
 }
 
 void DBImpl::ReleaseSnapshot(Snapshot *snapshot)
 {
+  snapshots_.remove(snapshot);
   delete snapshot;
 }
 
@@ -88,8 +198,73 @@ Iterator *DBImpl::NewIterator(Snapshot *snapshot)
   return new FilteredPrefixIteratorImpl(PREFIX_USER, snapshot);
 }
 
+Iterator *DBImpl::NewIterator()
+{
+  return new SnapshotIteratorImpl(PREFIX_USER, GetSnapshot());
+}
+
+SnapshotStats DBImpl::GetSnapshotStats()
+{
+  auto stats = snapshots_.stats();
+  stats.pinned_bytes = cache_.PinnedBytes();
+  return stats;
+}
+
+void DBImpl::SnapshotRegistry::add(const Snapshot *snapshot, uint64_t pos)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  auto it = entries_.insert(entries_.end(),
+      Entry{snapshot, pos, std::chrono::steady_clock::now(), false});
+  index_.emplace(snapshot, it);
+  positions_.insert(pos);
+}
+
+void DBImpl::SnapshotRegistry::remove(const Snapshot *snapshot)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  auto it = index_.find(snapshot);
+  assert(it != index_.end());
+  positions_.erase(positions_.find(it->second->pos));
+  entries_.erase(it->second);
+  index_.erase(it);
+}
+
+SnapshotStats DBImpl::SnapshotRegistry::stats() const
+{
+  SnapshotStats stats;
+  std::lock_guard<std::mutex> lk(lock_);
+  stats.num_snapshots = entries_.size();
+  if (!entries_.empty()) {
+    stats.oldest_position = *positions_.begin();
+    stats.oldest_age =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - entries_.front().created);
+  }
+  return stats;
+}
+
+std::vector<std::pair<uint64_t, std::chrono::milliseconds>>
+DBImpl::SnapshotRegistry::expired(std::chrono::seconds age)
+{
+  std::vector<std::pair<uint64_t, std::chrono::milliseconds>> out;
+  const auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lk(lock_);
+  for (auto& entry : entries_) {
+    const auto held = now - entry.created;
+    if (held < age) {
+      break;
+    }
+    if (!entry.reported) {
+      entry.reported = true;
+      out.emplace_back(entry.pos,
+          std::chrono::duration_cast<std::chrono::milliseconds>(held));
+    }
+  }
+  return out;
+}
+
 int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
-    uint64_t& latest_intention)
+    uint64_t& latest_intention, bool fill)
 {
   // the true parameter tells the entry service to set max_pos according to the
   // tail returned. this is important, because if this is a new log then tail
@@ -104,13 +279,23 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
 
   // intention_pos -> earliest (ai_pos, ai_blob)
   std::unordered_map<uint64_t,
-    std::pair<uint64_t, std::shared_ptr<cruzdb_proto::AfterImage>>> after_images;
+    std::pair<uint64_t, std::shared_ptr<AfterImage>>> after_images;
+
+  if (!fill) {
+    tail--;
+  }
+
+  point.tail_pos = tail;
 
   bool set_latest_intention = false;
 
+  // the newest checkpoint, if one is found before a restore point. it can't
+  // be used until the latest intention is known.
+  std::shared_ptr<cruzdb_proto::Checkpoint> checkpoint;
+
   auto it = entry_service->NewReverseIterator(tail, "find_restore_point");
   while (true) {
-    auto entry = it.NextEntry(true);
+    auto entry = it.NextEntry(fill);
     // if hole, skip. see github issue #33
 
     if (!entry)
@@ -124,6 +309,16 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
            set_latest_intention = true;
          }
 
+         if (checkpoint) {
+           point.replay_start_pos = checkpoint->intention() + 1;
+           point.after_image_pos = checkpoint->after_image();
+           point.after_image = entry_service->ReadAfterImage(
+               checkpoint->after_image());
+           point.checkpoint = checkpoint;
+           assert(point.after_image->Intention() == checkpoint->intention());
+           return 0;
+         }
+
          auto it = after_images.find(entry->first);
          if (it != after_images.end()) {
            // found a starting point, but still need to guarantee that the
@@ -131,7 +326,7 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
            point.replay_start_pos = entry->first + 1;
            point.after_image_pos = it->second.first;
            point.after_image = it->second.second;
-           assert(it->first == it->second.second->intention());
+           assert(it->first == it->second.second->Intention());
            return 0;
          }
        }
@@ -142,16 +337,24 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
         {
           assert(entry->first > 0);
           auto ai = entry->second.after_image;
-          auto it = after_images.find(ai->intention());
+          auto it = after_images.find(ai->Intention());
           if (it != after_images.end()) {
             after_images.erase(it);
           }
-          auto ret = after_images.emplace(ai->intention(),
+          auto ret = after_images.emplace(ai->Intention(),
               std::make_pair(entry->first, ai));
           assert(ret.second);
         }
         break;
 
+      // a checkpoint's intention precedes it in the log, so the scan always
+      // reaches an intention that completes the restore point.
+      case EntryService::CacheEntry::EntryType::CHECKPOINT:
+        if (!checkpoint) {
+          checkpoint = entry->second.checkpoint;
+        }
+        break;
+
       case EntryService::CacheEntry::EntryType::FILLED:
         break;
 
@@ -164,6 +367,78 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
   exit(1);
 }
 
+void DBImpl::FindRecoveryAfterImages(EntryService *entry_service,
+    size_t threads, RestorePoint& point)
+{
+  // the restore point scan read (or filled) every position up to and
+  // including the tail it observed, and the log scanner isn't running yet, so
+  // only those positions can be read here.
+  const auto first = point.replay_start_pos;
+  const auto last = point.tail_pos;
+  if (threads == 0 || first > last) {
+    return;
+  }
+
+  threads = std::min(threads, static_cast<size_t>(last - first + 1));
+
+  std::mutex lock;
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      for (uint64_t pos = first + t; pos <= last; pos += threads) {
+        auto entry = entry_service->Read(pos, true);
+        if (!entry) {
+          break;
+        }
+
+        if (entry->type != EntryService::CacheEntry::EntryType::AFTERIMAGE) {
+          continue;
+        }
+
+        // an after image of an intention that is part of the restored state
+        const auto& ai = entry->after_image;
+        if (ai->Intention() < first) {
+          continue;
+        }
+
+        // keep the primary (first) after image of each intention
+        std::lock_guard<std::mutex> lk(lock);
+        auto ret = point.after_images.emplace(ai->Intention(),
+            std::make_pair(pos, ai->NumNodes()));
+        if (!ret.second && pos < ret.first->second.first) {
+          ret.first->second = std::make_pair(pos, ai->NumNodes());
+        }
+      }
+    });
+  }
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+bool DBImpl::ReplaysMerges(EntryService *entry_service,
+    const RestorePoint& point)
+{
+  for (auto pos = point.replay_start_pos; pos <= point.tail_pos; pos++) {
+    if (point.after_images.count(pos)) {
+      continue;
+    }
+
+    auto entry = entry_service->Read(pos, true);
+    if (!entry) {
+      break;
+    }
+
+    if (entry->type == EntryService::CacheEntry::EntryType::INTENTION &&
+        entry->intention->HasMerges()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 int DBImpl::Validate(const SharedNodeRef root)
 {
   assert(root != nullptr);
@@ -198,7 +473,7 @@ int DBImpl::Validate(const SharedNodeRef root)
 
 void DBImpl::Validate()
 {
-  auto snapshot = root_;
+  auto snapshot = LatestRoot()->root;
   bool valid = Validate(snapshot.ref_notrace()) != 0;
   assert(valid);
 }
@@ -220,10 +495,13 @@ SharedNodeRef DBImpl::fetch(std::vector<NodeAddress>& trace,
 }
 
 int DBImpl::Get(const zlog::Slice& key, std::string *value)
+{
+  return Get(LatestRoot()->root, key, value);
+}
+
+int DBImpl::Get(NodePtr root, const zlog::Slice& key, std::string *value)
 {
   std::vector<NodeAddress> trace;
-  auto snap = GetSnapshot();
-  auto root = snap->root;
 
   // FIXME: this string/slice/prefix append conversion can be more efficient.
   // probably a lot more efficient.
@@ -246,98 +524,199 @@ int DBImpl::Get(const zlog::Slice& key, std::string *value)
   return -ENOENT;
 }
 
-Transaction *DBImpl::BeginTransaction()
+Transaction *DBImpl::BeginTransaction(const TransactionOptions& options)
 {
-  std::lock_guard<std::mutex> lk(lock_);
-  db_stats_.transactions_started++;
+  const auto latest = LatestRoot();
+
+  if (options.read_only) {
+    transactions_started_++;
+    if (logger_)
+      logger_->info("begin-txn snap {} read-only", latest->snapshot);
+    return new ReadOnlyTransaction(this, NewSnapshot(*latest));
+  }
+
+  if (options_.follower) {
+    return nullptr;
+  }
+
+  transactions_started_++;
   auto txn = new TransactionImpl(this,
-      root_,
-      root_snapshot_,
+      latest->root,
+      latest->snapshot,
       in_flight_txn_rid_--,
-      txn_finder_.NewToken());
+      txn_finder_.NewToken(),
+      options);
+  if (options_.meld_intentions)
+    txn->TrackTreeReads();
   if (logger_)
-    logger_->info("begin-txn snap {}", root_snapshot_);
+    logger_->info("begin-txn snap {} isolation {}", latest->snapshot,
+        static_cast<int>(options.isolation));
   return txn;
 }
 
 void DBImpl::WaitOnIntention(uint64_t pos)
 {
-  bool done = false;
-  std::condition_variable cond;
-  std::unique_lock<std::mutex> lk(lock_);
-  if (pos <= last_intention_processed_) {
-    return;
-  }
-  waiting_on_log_entry_.emplace(pos, std::make_pair(&cond, &done));
-  cond.wait(lk, [&] { return done; });
+  processed_.wait(pos, boost::none);
+}
+
+bool DBImpl::WaitForPosition(uint64_t pos, std::chrono::microseconds timeout)
+{
+  return processed_.wait(pos, timeout);
 }
 
 void DBImpl::NotifyIntention(uint64_t pos)
 {
-  auto first = waiting_on_log_entry_.begin();
-  auto last = waiting_on_log_entry_.upper_bound(pos);
-  std::for_each(first, last, [pos](auto& w) {
-    assert(w.first <= pos);
-    *w.second.second = true;
-    w.second.first->notify_one();
-  });
-  waiting_on_log_entry_.erase(first, last);
+  assert(processed_.pos() < pos);
+  processed_.publish(pos);
+}
+
+// puts record the prefixed key that is inserted into the tree, while gets,
+// deletes and merges record the user key. conflicts are found by comparing
+// tree keys.
+std::string DBImpl::OpTreeKey(const cruzdb_proto::TransactionOp& op)
+{
+  switch (op.op()) {
+    case cruzdb_proto::TransactionOp::GET:
+    case cruzdb_proto::TransactionOp::DELETE:
+    case cruzdb_proto::TransactionOp::MERGE:
+      return prefix_string(PREFIX_USER, op.key());
+
+    default:
+      return op.key();
+  }
+}
+
+// set of keys read or written by the intention. a snapshot isolation intention
+// has no reads, so only its writes can conflict. merges are applied to
+// whatever the latest value is, so they never conflict.
+std::set<std::string> DBImpl::ConflictKeys(const Intention& intention)
+{
+  std::set<std::string> intention_keys;
+  for (const auto& op : intention) {
+    if (op.op() != cruzdb_proto::TransactionOp::MERGE) {
+      intention_keys.insert(OpTreeKey(op));
+    }
+  }
+  return intention_keys;
+}
+
+bool DBImpl::Conflicts(const Intention& intention,
+    const std::set<std::string>& intention_keys,
+    const Intention& other_intention)
+{
+  // set of keys modified by the other intention
+  std::set<std::string> other_intention_keys;
+  for (const auto& op : other_intention) {
+    if (op.op() == cruzdb_proto::TransactionOp::PUT ||
+        op.op() == cruzdb_proto::TransactionOp::DELETE ||
+        op.op() == cruzdb_proto::TransactionOp::MERGE) {
+      other_intention_keys.insert(OpTreeKey(op));
+    }
+  }
+
+  // conflict if the set of keys intersect
+  for (const auto& k0 : intention_keys) {
+    if (other_intention_keys.find(k0) !=
+        other_intention_keys.end()) {
+      return true;
+    }
+  }
+
+  // conflict if a key was written into a scanned range. the ranges are sorted
+  // and disjoint, so each key is a single binary search.
+  return intention.HasReadRanges() &&
+    UpdatesReadRange(intention, other_intention);
 }
 
 bool DBImpl::ProcessConcurrentIntention(const Intention& intention)
 {
-  // set of keys read or written by the intention
-  auto intention_keys = intention.OpKeys();
+  const auto intention_keys = ConflictKeys(intention);
 
   const auto snapshot = intention.Snapshot();
-  auto irange = committed_intentions_.range(snapshot, root_snapshot_);
+  const auto latest = LatestRoot()->snapshot;
+  auto irange = committed_intentions_.range(snapshot, latest);
   if (!irange.second) {
-    Snapshot snap(this, root_); // TODO: lock to read root_?
-    FilteredPrefixIteratorImpl it(PREFIX_COMMITTED_INTENTION, &snap);
+    assert(!irange.first.empty());
+    auto older = ScanCommittedIntentions(snapshot, irange.first.front());
+    irange.first.insert(irange.first.begin(), older.begin(), older.end());
+  }
 
-    std::stringstream key;
-    key << std::setw(20) << std::setfill('0') << snapshot;
+  auto other_intentions = entry_service_->ReadIntentions(irange.first);
 
-    it.Seek(key.str());
-    assert(it.Valid());
-    assert(boost::lexical_cast<uint64_t>(it.key().ToString()) == snapshot);
+  for (auto& other_intention : other_intentions) {
+    if (Conflicts(intention, intention_keys, *other_intention)) {
+      return true;
+    }
+  }
 
-    it.Next();
-    assert(it.Valid());
+  return false;
+}
 
-    while (it.Valid()) {
-      auto key = it.key();
-      auto pos = boost::lexical_cast<uint64_t>(key.ToString());
-      if (pos == irange.first.front())
-        break;
-      irange.first.emplace_back(pos);
-      it.Next();
+// every intention that has committed after the snapshot of an intention will
+// be in its conflict zone, so a conflict with any of them means that the
+// intention is certain to abort. only the intentions still in the committed
+// intention index are checked.
+bool DBImpl::ConflictsWithCommitted(const Intention& intention)
+{
+  const auto latest = LatestRoot()->snapshot;
+
+  const auto snapshot = intention.Snapshot();
+  if (latest <= snapshot) {
+    return false;
+  }
+
+  const auto irange = committed_intentions_.range(snapshot, latest);
+  if (irange.first.empty()) {
+    return false;
+  }
+
+  const auto intention_keys = ConflictKeys(intention);
+  for (auto& other_intention :
+      entry_service_->ReadIntentions(irange.first)) {
+    if (Conflicts(intention, intention_keys, *other_intention)) {
+      return true;
     }
   }
 
-  auto other_intentions = entry_service_->ReadIntentions(irange.first);
+  return false;
+}
 
-  for (auto& other_intention : other_intentions) {
-    // set of keys modified by the intention in the conflict zone
-    auto other_intention_keys = other_intention->UpdateOpKeys();
-
-    // return abort=true if the set of keys intersect
-    for (auto k0 : intention_keys) {
-      if (other_intention_keys.find(k0) !=
-          other_intention_keys.end()) {
-        return true;
-      }
+bool DBImpl::UpdatesReadRange(const Intention& intention,
+    const Intention& other_intention)
+{
+  // read ranges hold user keys, while put operations record the prefixed key
+  // that is inserted into the tree.
+  const auto user_prefix = prefix_string(PREFIX_USER, "");
+
+  for (const auto& op : other_intention) {
+    switch (op.op()) {
+      case cruzdb_proto::TransactionOp::PUT:
+        if (op.key().compare(0, user_prefix.size(), user_prefix) == 0 &&
+            intention.ReadRangesContain(op.key().substr(user_prefix.size()))) {
+          return true;
+        }
+        break;
+
+      case cruzdb_proto::TransactionOp::DELETE:
+      case cruzdb_proto::TransactionOp::MERGE:
+        if (intention.ReadRangesContain(op.key())) {
+          return true;
+        }
+        break;
+
+      default:
+        break;
     }
   }
 
   return false;
 }
 
-void DBImpl::NotifyTransaction(int64_t token, uint64_t intention_pos,
-    bool committed)
+std::function<void()> DBImpl::NotifyTransaction(int64_t token,
+    uint64_t intention_pos, bool committed)
 {
   NotifyIntention(intention_pos);
-  txn_finder_.Notify(token, intention_pos, committed);
+  return txn_finder_.Notify(token, intention_pos, committed);
 }
 
 void DBImpl::ReplayIntention(PersistentTree *tree, const Intention& intention)
@@ -363,6 +742,18 @@ void DBImpl::ReplayIntention(PersistentTree *tree, const Intention& intention)
         tree->Copy(op.key());
         break;
 
+      case cruzdb_proto::TransactionOp::MERGE:
+        assert(op.has_val());
+        // DB::Open won't roll merges forward without an operator, so this is
+        // a merge appended by another instance after open, or a failed merge.
+        if (MergeValue(tree, op.key(), op.val())) {
+          std::cerr << "failed to replay merge at intention "
+            << intention.Position() << std::endl;
+          assert(0);
+          exit(1);
+        }
+        break;
+
       default:
         assert(0);
         exit(1);
@@ -370,6 +761,28 @@ void DBImpl::ReplayIntention(PersistentTree *tree, const Intention& intention)
   }
 }
 
+int DBImpl::MergeValue(PersistentTree *tree, const zlog::Slice& key,
+    const zlog::Slice& operand)
+{
+  if (!options_.merge_operator) {
+    return -EINVAL;
+  }
+
+  std::string existing;
+  const int ret = tree->Get(PREFIX_USER, key, &existing);
+  assert(ret == 0 || ret == -ENOENT);
+  const zlog::Slice existing_value(existing);
+
+  std::string value;
+  if (!options_.merge_operator->Merge(key,
+        ret == 0 ? &existing_value : nullptr, operand, &value)) {
+    return -EINVAL;
+  }
+
+  tree->Put(PREFIX_USER, key, value);
+  return 0;
+}
+
 void DBImpl::TransactionProcessorEntry()
 {
   while (true) {
@@ -388,8 +801,18 @@ void DBImpl::TransactionProcessorEntry()
     // it has no conflicts. be careful that serial doesn't examine anything in
     // the flush intention that might not be set given the flush intention's
     // special cases.
-    assert(root_snapshot_ < intention_pos);
-    const auto serial = root_snapshot_ == intention->Snapshot() ||
+    assert(LatestRoot()->snapshot < intention_pos);
+
+    if (!recovery_after_images_.empty()) {
+      auto it = recovery_after_images_.find(intention_pos);
+      if (it != recovery_after_images_.end()) {
+        RecoverIntention(*intention, it->second.first, it->second.second);
+        recovery_after_images_.erase(it);
+        continue;
+      }
+    }
+
+    const auto serial = LatestRoot()->snapshot == intention->Snapshot() ||
       intention->Flush();
 
     // check for conflicts
@@ -402,19 +825,16 @@ void DBImpl::TransactionProcessorEntry()
 
     // abort: notify waiters before moving on
     if (abort) {
-      std::lock_guard<std::mutex> lk(lock_);
-      NotifyTransaction(intention->Token(), intention_pos, false);
-      assert(last_intention_processed_ < intention_pos);
-      last_intention_processed_ = intention_pos;
+      auto completion = NotifyTransaction(intention->Token(),
+          intention_pos, false);
+      if (completion) {
+        completion();
+      }
       continue;
     }
 
     committed_intentions_.push(intention_pos);
 
-    // committed intention key
-    std::stringstream ci_key;
-    ci_key << std::setw(20) << std::setfill('0') << intention_pos;
-
     bool need_replay;
     std::unique_ptr<PersistentTree> next_root;
     if (serial) {
@@ -427,36 +847,43 @@ void DBImpl::TransactionProcessorEntry()
         need_replay = true;
       }
     } else {
-      need_replay = true;
+      // a local transaction's tree was built against its snapshot. it can
+      // still be used if melding it onto the latest tree gives the same
+      // result as replaying the intention. merged values depend on the
+      // latest value of the key, so an intention with merges is replayed.
+      // a tree that didn't keep its reads (see AppendTransaction) is
+      // replayed too.
+      auto tmp = options_.meld_intentions && !intention->HasMerges() ?
+        finished_txns_.Find(intention_pos) : nullptr;
+      if (tmp && tmp->TracksReads()) {
+        if (tmp->Meld(LatestRoot()->root)) {
+          RecordTick(stats_, TXN_INTENTIONS_MELDED);
+          next_root = std::move(tmp);
+          need_replay = false;
+        } else {
+          RecordTick(stats_, TXN_INTENTIONS_MELD_FAILED);
+          need_replay = true;
+        }
+      } else {
+        need_replay = true;
+      }
     }
 
     boost::optional<int> root_offset;
     if (need_replay) {
-      // really need this lock? it's really only here for the read of root_, but
-      // that shouldn't need a lock since this thread is the only thread that
-      // can write to root_.
-      std::unique_lock<std::mutex> lk(lock_);
-      next_root = std::make_unique<PersistentTree>(this, root_,
+      next_root = std::make_unique<PersistentTree>(this, LatestRoot()->root,
           static_cast<int64_t>(intention_pos),
           intention_pos);
-      lk.unlock();
       ReplayIntention(next_root.get(), *intention);
-      next_root->Put(PREFIX_COMMITTED_INTENTION, ci_key.str(), "");
       root_offset = next_root->infect_self_pointers(intention_pos, true);
     } else {
-      // first impressions are that this Put here really kills performance.
-      // Persumably because its jsut overhead in a strictly serial process. It's
-      // possible that we could store this information in a different way: for
-      // example as just a bunch of backpointers. This would be slower for
-      // finding than in the after image, but in both cases we are going to try
-      // to aggressively cache these entries. We could optimize the LRU for this
-      // index to keep the info around a long time and/or give preference to
-      // this part of the tree in the node cache.
-      next_root->Put(PREFIX_COMMITTED_INTENTION, ci_key.str(), "");
       // this also fixes up the rid. see method for details
       root_offset = next_root->infect_self_pointers(intention_pos, false);
     }
-    assert(root_offset);
+
+    // committed intentions are chained together through their after images
+    // rather than being recorded in the tree. see ScanCommittedIntentions.
+    next_root->SetPrevIntention(LatestRoot()->snapshot);
 
     assert(next_root->Root() != nullptr);
     NodePtr root(next_root->Root(), this);
@@ -465,18 +892,95 @@ void DBImpl::TransactionProcessorEntry()
       root.SetIntentionAddress(intention_pos, *root_offset);
     }
 
-    std::unique_lock<std::mutex> lk(lock_);
+    PublishRoot(root, intention_pos);
 
-    root_ = root;
-    root_snapshot_ = intention_pos;
+    {
+      std::lock_guard<std::mutex> lk(lcs_trees_lock_);
+      lcs_trees_.emplace_back(std::move(next_root));
+      lcs_trees_cond_.notify_one();
+    }
 
-    assert(last_intention_processed_ < intention_pos);
-    last_intention_processed_ = intention_pos;
+    auto completion = NotifyTransaction(intention->Token(),
+        intention_pos, true);
+    if (completion) {
+      completion();
+    }
+  }
+}
 
-    lcs_trees_.emplace_back(std::move(next_root));
-    lcs_trees_cond_.notify_one();
+// an intention with an after image already in the log committed, and the
+// after image holds the resulting tree. rather than checking for conflicts and
+// replaying the intention, the root is pointed at the after image and its
+// nodes are read on demand.
+void DBImpl::RecoverIntention(const Intention& intention,
+    uint64_t after_image_pos, int num_nodes)
+{
+  const auto intention_pos = intention.Position();
+
+  if (logger_)
+    logger_->info("txn-proc: recover ipos {} ai_pos {}", intention_pos,
+        after_image_pos);
+
+  RecordTick(stats_, RECOVERY_AFTER_IMAGES_REUSED);
+
+  committed_intentions_.push(intention_pos);
+  committed_intentions_.finalize(intention_pos);
+  cache_.SetIntentionMapping(intention_pos, after_image_pos);
+  entry_service_->ai_matcher.skip(intention_pos);
+
+  // the root of an after image is its last node, and an empty after image is
+  // an empty tree.
+  NodePtr root(num_nodes > 0 ? nullptr : Node::Nil(), this);
+  if (num_nodes > 0) {
+    root.SetAfterImageAddress(after_image_pos, num_nodes - 1);
+  }
+
+  PublishRoot(root, intention_pos);
+
+  auto completion = NotifyTransaction(intention.Token(), intention_pos, true);
+  if (completion) {
+    completion();
+  }
+}
+
+// a follower installs the after images written by other instances as its
+// latest state. after images may be duplicated or appear after the after
+// images of newer intentions, so only after images that move the state forward
+// are used.
+void DBImpl::FollowerEntry(uint64_t pos)
+{
+  auto it = entry_service_->NewAfterImageIterator(pos);
+  while (true) {
+    auto ai = it.Next();
+    if (!ai) {
+      break;
+    }
+
+    const auto ai_pos = ai->first;
+    const auto& after_image = ai->second;
+    const auto intention_pos = after_image->Intention();
+
+    cache_.SetIntentionMapping(intention_pos, ai_pos);
+
+    // the processed position is only published by this thread
+    if (intention_pos <= processed_.pos()) {
+      continue;
+    }
+
+    if (logger_)
+      logger_->info("follower: ipos {} ai_pos {}", intention_pos, ai_pos);
 
-    NotifyTransaction(intention->Token(), intention_pos, true);
+    auto root = cache_.CacheAfterImage(*after_image, ai_pos);
+    entry_service_->ReleaseAfterImage(ai_pos);
+
+    // the first after image of each intention is written in commit order, so
+    // every commit is installed and the index stays contiguous.
+    committed_intentions_.push(intention_pos);
+    committed_intentions_.finalize(intention_pos);
+
+    PublishRoot(root, intention_pos);
+
+    NotifyIntention(intention_pos);
   }
 }
 
@@ -487,7 +991,7 @@ void DBImpl::TransactionProcessorEntry()
 //  - no multi-client writer policy
 void DBImpl::AfterImageWriterEntry()
 {
-  std::unique_lock<std::mutex> lk(lock_);
+  std::unique_lock<std::mutex> lk(lcs_trees_lock_);
   while (true) {
     lcs_trees_cond_.wait(lk, [&] {
         return !lcs_trees_.empty() || stop_; });
@@ -503,9 +1007,9 @@ void DBImpl::AfterImageWriterEntry()
       const auto intention_pos = tree->Intention();
 
       std::vector<SharedNodeRef> delta;
-      cruzdb_proto::AfterImage after_image;
+      AfterImageBuilder after_image(options_.flat_after_images);
       tree->SerializeAfterImage(after_image, intention_pos, delta);
-      assert(after_image.intention() == intention_pos);
+      assert(after_image.Intention() == intention_pos);
 
       entry_service_->ai_matcher.watch(std::move(delta), std::move(tree));
 
@@ -523,6 +1027,7 @@ void DBImpl::AfterImageWriterEntry()
 
 void DBImpl::AfterImageFinalizerEntry()
 {
+  size_t finalized = 0;
   while (true) {
     auto tree_info = entry_service_->ai_matcher.match();
     if (!tree_info.second)
@@ -541,37 +1046,120 @@ void DBImpl::AfterImageFinalizerEntry()
     tree->SetDeltaPosition(delta, ai_pos);
     cache_.SetIntentionMapping(ipos, ai_pos);
     cache_.ApplyAfterImageDelta(delta, ai_pos);
+    committed_intentions_.finalize(ipos);
+
+    if (options_.checkpoint_interval > 0 &&
+        ++finalized % options_.checkpoint_interval == 0) {
+      WriteCheckpoint(ipos, ai_pos);
+    }
 
-    std::unique_lock<std::mutex> lk(lock_);
     if (stop_)
       break;
   }
 }
 
-bool DBImpl::CompleteTransaction(TransactionImpl *txn)
+// the after image for the intention is the primary after image that was
+// matched by the finalizer, so together they are a valid restore point.
+void DBImpl::WriteCheckpoint(uint64_t intention_pos, uint64_t after_image_pos)
 {
-  // setup transaction rendezvous under this token
-  const auto token = txn->Token();
-  TransactionFinder::WaiterHandle waiter;
-  txn_finder_.AddTokenWaiter(waiter, token);
+  cruzdb_proto::Checkpoint checkpoint;
+  checkpoint.set_intention(intention_pos);
+  checkpoint.set_after_image(after_image_pos);
+
+  // the index is restored from the newest positions, and older conflict
+  // zones are found in the log. only the most recently used mappings are
+  // likely to be needed again.
+  for (const auto pos : committed_intentions_.positions(intention_pos,
+        options_.checkpoint_index_size)) {
+    checkpoint.add_committed_intentions(pos);
+  }
+
+  for (const auto& mapping :
+      cache_.IntentionMappings(options_.checkpoint_index_size)) {
+    checkpoint.add_imap_intentions(mapping.first);
+    checkpoint.add_imap_after_images(mapping.second);
+  }
+
+  const auto pos = entry_service_->Append(checkpoint);
+
+  if (logger_)
+    logger_->info("checkpoint: pos {} i_pos {} ai_pos {}", pos,
+        intention_pos, after_image_pos);
+}
+
+bool DBImpl::AbortBeforeAppend(const Intention& intention)
+{
+  if (options_.precommit_conflict_check &&
+      ConflictsWithCommitted(intention)) {
+    RecordTick(stats_, TXN_ABORTED_BEFORE_APPEND);
+    return true;
+  }
+  return false;
+}
+
+uint64_t DBImpl::AppendTransaction(TransactionImpl *txn,
+    std::unique_ptr<Intention> intention)
+{
+  // a transaction whose snapshot is still the latest root is expected to be
+  // processed serially, and its tree is used as is. its reads are only kept
+  // if the tree may need to be melded onto newer commits.
+  const auto snapshot = intention->Snapshot();
+  auto tree = std::move(txn->Tree());
+  if (snapshot == LatestRoot()->snapshot) {
+    tree->DropReads();
+  }
 
   // MOVE txn's intention to the append io service
-  auto pos = entry_service_->Append(std::move(txn->GetIntention()));
+  auto pos = entry_service_->Append(std::move(intention));
 
   // MOVE txn's tree into index for txn processor
-  auto tree = std::move(txn->Tree());
   tree->SetIntention(pos);
   finished_txns_.Insert(pos, std::move(tree));
 
+  return pos;
+}
+
+bool DBImpl::CompleteTransaction(TransactionImpl *txn)
+{
+  auto intention = txn->GetIntention();
+  if (AbortBeforeAppend(*intention)) {
+    return false;
+  }
+
+  // setup transaction rendezvous under this token
+  TransactionFinder::WaiterHandle waiter;
+  txn_finder_.AddTokenWaiter(waiter, txn->Token());
+
+  auto pos = AppendTransaction(txn, std::move(intention));
+
   bool committed = txn_finder_.WaitOnTransaction(waiter, pos);
 
   return committed;
 }
 
+// the waiter is registered with the callback before the intention is
+// appended, so the processor may deliver the decision as soon as the
+// intention's position is known.
+void DBImpl::CompleteTransactionAsync(TransactionImpl *txn,
+    std::function<void(bool)> callback)
+{
+  auto intention = txn->GetIntention();
+  if (AbortBeforeAppend(*intention)) {
+    callback(false);
+    return;
+  }
+
+  auto waiter = txn_finder_.AddTokenWaiter(txn->Token(), std::move(callback));
+
+  auto pos = AppendTransaction(txn, std::move(intention));
+
+  txn_finder_.WaitOnTransactionAsync(waiter, pos);
+}
+
 std::map<uint64_t, std::pair<uint64_t, uint64_t>>
 DBImpl::reachable_node_stats()
 {
-  auto node = root_.ref_notrace();
+  auto node = LatestRoot()->root.ref_notrace();
 
   // build a list of all node addresses that are reachable
   std::map<NodeAddress, std::string> addrs;
@@ -611,7 +1199,7 @@ DBImpl::reachable_node_stats()
     auto ai_addr = cache_.findAfterImagePosition(addr.first);
     if (usage.find(ai_addr) == usage.end()) {
       auto ai = entry_service_->ReadAfterImage(ai_addr);
-      usage.emplace(ai_addr, std::make_pair(ai->tree_size(), 0));
+      usage.emplace(ai_addr, std::make_pair(ai->NumNodes(), 0));
     }
     usage[ai_addr].second++;
   }
@@ -629,7 +1217,7 @@ DBImpl::reachable_node_stats()
 // node copies where the children are further back in the log...
 void DBImpl::gc()
 {
-  auto node = root_.ref_notrace();
+  auto node = LatestRoot()->root.ref_notrace();
 
   std::map<NodeAddress, std::string> addrs;
   std::stack<SharedNodeRef> stack;
@@ -678,23 +1266,20 @@ void DBImpl::gc()
 
   auto pos = entry_service_->Append(std::move(flush));
 
-  std::unique_lock<std::mutex> lk(lock_);
-  while (last_intention_processed_ < pos) {
-    lk.unlock();
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    lk.lock();
-  }
+  WaitOnIntention(pos);
 }
 
 void DBImpl::TransactionFinder::AddTokenWaiter(
     WaiterHandle& whandle, uint64_t token)
 {
-  std::lock_guard<std::mutex> lk(lock_);
+  auto& shard = this->shard(token);
+  std::lock_guard<std::mutex> lk(shard.lock);
 
   auto& waiter = whandle.waiter;
+  whandle.shard = &shard;
 
   // register this waiter under the given token
-  auto ret = token_waiters_.emplace(token, &waiter);
+  auto ret = shard.token_waiters.emplace(token, &waiter);
   if (!ret.second) {
     assert(ret.first->first == token);
     ret.first->second.waiters.emplace_back(&waiter);
@@ -711,7 +1296,7 @@ void DBImpl::TransactionFinder::AddTokenWaiter(
 bool DBImpl::TransactionFinder::WaitOnTransaction(
     WaiterHandle& whandle, uint64_t intention_pos)
 {
-  std::unique_lock<std::mutex> lk(lock_);
+  std::unique_lock<std::mutex> lk(whandle.shard->lock);
 
   auto& waiter = whandle.waiter;
 
@@ -749,27 +1334,88 @@ bool DBImpl::TransactionFinder::WaitOnTransaction(
   // erase token entry if there are no associations
   if (whandle.token_it->second.waiters.empty() &&
       whandle.token_it->second.results.empty()) {
-    token_waiters_.erase(whandle.token_it);
+    whandle.shard->token_waiters.erase(whandle.token_it);
   }
 
   return committed;
 }
 
-void DBImpl::TransactionFinder::Notify(int64_t token,
+DBImpl::TransactionFinder::WaiterHandle*
+DBImpl::TransactionFinder::AddTokenWaiter(uint64_t token,
+    std::function<void(bool)> callback)
+{
+  auto whandle = new WaiterHandle;
+  whandle->waiter.callback = std::move(callback);
+  whandle->waiter.owner = whandle;
+  AddTokenWaiter(*whandle, token);
+  return whandle;
+}
+
+void DBImpl::TransactionFinder::WaitOnTransactionAsync(
+    WaiterHandle *whandle, uint64_t intention_pos)
+{
+  std::unique_lock<std::mutex> lk(whandle->shard->lock);
+
+  auto& waiter = whandle->waiter;
+  assert(waiter.callback);
+  assert(!waiter.pos);
+  waiter.pos = intention_pos;
+
+  // until the position is set the processor can only record the result
+  auto& results = whandle->token_it->second.results;
+  auto it = results.find(intention_pos);
+  if (it == results.end()) {
+    return;
+  }
+
+  const bool committed = it->second;
+  whandle->token_it->second.waiters.erase(whandle->waiter_it);
+  results.erase(it);
+  if (whandle->token_it->second.waiters.empty() &&
+      whandle->token_it->second.results.empty()) {
+    whandle->shard->token_waiters.erase(whandle->token_it);
+  }
+
+  lk.unlock();
+
+  auto callback = std::move(waiter.callback);
+  delete whandle;
+  callback(committed);
+}
+
+std::function<void()> DBImpl::TransactionFinder::Notify(int64_t token,
     uint64_t intention_pos, bool committed)
 {
-  std::lock_guard<std::mutex> lk(lock_);
+  auto& shard = this->shard(token);
+  std::lock_guard<std::mutex> lk(shard.lock);
 
   // if a token is not found, then a different instance of the database produced
   // the transaction. in this case there are no waiters to notify.
-  auto it = token_waiters_.find(token);
-  if (it == token_waiters_.end())
-    return;
+  auto it = shard.token_waiters.find(token);
+  if (it == shard.token_waiters.end())
+    return nullptr;
 
   // at least one transaction is waiting under this token
   auto& tx = it->second;
   assert(!tx.waiters.empty());
 
+  // an asynchronous waiter has no thread to look for its result, so it is
+  // completed here even if it isn't first in line.
+  auto aw = std::find_if(tx.waiters.begin(), tx.waiters.end(),
+      [intention_pos](auto w) {
+        return w->callback && w->pos && *w->pos == intention_pos;
+      });
+  if (aw != tx.waiters.end()) {
+    auto whandle = (*aw)->owner;
+    tx.waiters.erase(aw);
+    if (tx.waiters.empty() && tx.results.empty()) {
+      shard.token_waiters.erase(it);
+    }
+    auto callback = std::move(whandle->waiter.callback);
+    delete whandle;
+    return [callback, committed] { callback(committed); };
+  }
+
   // fast path: first waiter is for this intention position
   auto fw = tx.waiters.front();
   if (fw->pos && fw->pos == intention_pos) {
@@ -788,6 +1434,8 @@ void DBImpl::TransactionFinder::Notify(int64_t token,
       w->cond.notify_one();
     });
   }
+
+  return nullptr;
 }
 
 std::unique_ptr<PersistentTree>
@@ -825,14 +1473,112 @@ void DBImpl::FinishedTransactions::Clean(uint64_t last_ipos)
   // unused_trees destructor called after lock is released
 }
 
+DBImpl::ProcessedPosition::ProcessedPosition(uint64_t pos) :
+  pos_(pos),
+  num_waiters_(0)
+{
+}
+
+// a waiter registers itself before checking the position again, and the
+// position is stored before the number of waiters is checked, so either the
+// waiter sees the new position or the publisher sees the waiter.
+void DBImpl::ProcessedPosition::publish(uint64_t pos)
+{
+  assert(pos_.load() <= pos);
+  pos_.store(pos);
+
+  if (num_waiters_.load() == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lk(lock_);
+  auto last = waiters_.upper_bound(pos);
+  for (auto it = waiters_.begin(); it != last; it++) {
+    it->second->done = true;
+    it->second->cond.notify_one();
+    num_waiters_--;
+  }
+  waiters_.erase(waiters_.begin(), last);
+}
+
+bool DBImpl::ProcessedPosition::wait(uint64_t pos,
+    boost::optional<std::chrono::microseconds> timeout)
+{
+  if (pos <= pos_.load()) {
+    return true;
+  }
+
+  Waiter waiter;
+  std::unique_lock<std::mutex> lk(lock_);
+  auto it = waiters_.emplace(pos, &waiter);
+  num_waiters_++;
+
+  bool done;
+  if (pos <= pos_.load()) {
+    done = waiter.done;
+  } else if (timeout) {
+    done = waiter.cond.wait_for(lk, *timeout, [&] { return waiter.done; });
+  } else {
+    waiter.cond.wait(lk, [&] { return waiter.done; });
+    return true;
+  }
+
+  if (!done) {
+    waiters_.erase(it);
+    num_waiters_--;
+  }
+
+  return done || pos <= pos_.load();
+}
+
+DBImpl::CommittedIntentionIndex::CommittedIntentionIndex(size_t capacity) :
+  capacity_(std::max(capacity, (size_t)1)),
+  covered_(0),
+  finalized_(0)
+{
+}
+
+void DBImpl::CommittedIntentionIndex::init(uint64_t pos)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  assert(index_.empty());
+  covered_ = pos;
+  finalized_ = pos;
+}
+
 void DBImpl::CommittedIntentionIndex::push(uint64_t pos)
 {
-  auto ret = index_.emplace(pos);
-  assert(ret.second);
-  assert(++ret.first == index_.end());
-  if (index_.size() > limit_) {
-    index_.erase(index_.begin());
+  std::lock_guard<std::mutex> lk(lock_);
+  assert(index_.empty() || index_.back() < pos);
+  index_.push_back(pos);
+  evict();
+}
+
+void DBImpl::CommittedIntentionIndex::finalize(uint64_t pos)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  finalized_ = std::max(finalized_, pos);
+  evict();
+}
+
+// evict a range of the oldest positions at once rather than one position per
+// push, keeping most of the index. positions whose after images are still
+// being written stay in the index until they are finalized.
+void DBImpl::CommittedIntentionIndex::evict()
+{
+  if (index_.size() <= capacity_) {
+    return;
   }
+
+  const auto end = std::upper_bound(index_.begin(), index_.end(), finalized_);
+  const auto evict = std::min(index_.size() - capacity_ + capacity_ / 8,
+      (size_t)(end - index_.begin()));
+  if (evict == 0) {
+    return;
+  }
+
+  covered_ = index_[evict - 1];
+  index_.erase(index_.begin(), index_.begin() + evict);
 }
 
 std::pair<std::vector<uint64_t>, bool>
@@ -840,30 +1586,163 @@ DBImpl::CommittedIntentionIndex::range(uint64_t first, uint64_t last) const
 {
   assert(first < last);
 
-  if (index_.empty()) {
-    return std::make_pair(std::vector<uint64_t>{{last}}, false);
+  std::lock_guard<std::mutex> lk(lock_);
+
+  // oldest position > first, and the end of the range. last is the newest
+  // committed intention, which isn't indexed if nothing has been pushed since
+  // the index was initialized.
+  auto it = std::upper_bound(index_.begin(), index_.end(), first);
+  auto it2 = std::upper_bound(it, index_.end(), last);
+  assert((it2 != index_.begin() && *std::prev(it2) == last) ||
+      (index_.empty() && last == covered_));
+
+  // everything after covered_ is indexed
+  const bool complete = first >= covered_;
+
+  // covered_ is the oldest committed intention known to the index, and its
+  // after image has been written. it's where a scan of older positions
+  // starts.
+  std::vector<uint64_t> positions;
+  if (!complete) {
+    positions.emplace_back(covered_);
   }
+  positions.insert(positions.end(), it, it2);
 
-  // oldest position >= first
-  auto it = index_.lower_bound(first);
-  assert(it != index_.end());
+  return std::make_pair(positions, complete);
+}
 
-  bool complete;
-  if (*it == first) {
-    std::next(it);
-    complete = true;
-  } else {
-    // the range (first, *it] is unknown
-    complete = false;
+std::vector<uint64_t>
+DBImpl::CommittedIntentionIndex::positions(uint64_t last,
+    size_t limit) const
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  const auto end = std::upper_bound(index_.begin(), index_.end(), last);
+  const auto count = std::min(limit, (size_t)(end - index_.begin()));
+  return std::vector<uint64_t>(end - count, end);
+}
+
+std::pair<uint64_t, bool>
+DBImpl::CommittedIntentionIndex::floor(uint64_t pos) const
+{
+  std::lock_guard<std::mutex> lk(lock_);
+
+  auto it = std::upper_bound(index_.begin(), index_.end(), pos);
+  if (it != index_.begin()) {
+    return std::make_pair(*std::prev(it), true);
   }
 
-  auto it2 = index_.find(last);
-  assert(it2 != index_.end());
+  // covered_ is the newest committed intention older than the index
+  return std::make_pair(covered_, pos >= covered_);
+}
+
+std::string DBImpl::CommittedIntentionKey(uint64_t pos)
+{
+  std::string key;
+  PutBigEndian64(&key, pos);
+  return key;
+}
+
+uint64_t DBImpl::ParseCommittedIntentionKey(const zlog::Slice& key)
+{
+  if (key.size() == sizeof(uint64_t)) {
+    return DecodeBigEndian64(key.data());
+  }
+  return boost::lexical_cast<uint64_t>(key.ToString());
+}
+
+std::vector<uint64_t> DBImpl::ScanCommittedIntentions(uint64_t first,
+    uint64_t last)
+{
+  std::vector<uint64_t> positions;
+
+  auto pos = last;
+  while (true) {
+    const auto ai_pos = cache_.findAfterImagePosition(
+        NodeAddress(pos, 0, false));
+    const auto prev = entry_service_->ReadAfterImage(ai_pos)->PrevIntention();
+
+    if (!prev) {
+      // the chain reached after images written before commit backpointers,
+      // when every commit was recorded in the catalog.
+      auto older = ScanCatalog(first, pos);
+      positions.insert(positions.end(), older.rbegin(), older.rend());
+      break;
+    }
 
-  std::vector<uint64_t> res;
-  std::copy(it, std::next(it2), std::back_inserter(res));
+    if (*prev <= first) {
+      break;
+    }
 
-  return std::make_pair(res, complete);
+    positions.emplace_back(*prev);
+    pos = *prev;
+  }
+
+  std::reverse(positions.begin(), positions.end());
+  return positions;
+}
+
+uint64_t DBImpl::FindCommittedIntention(uint64_t pos, uint64_t last)
+{
+  assert(pos < last);
+
+  while (true) {
+    const auto ai_pos = cache_.findAfterImagePosition(
+        NodeAddress(last, 0, false));
+    const auto prev = entry_service_->ReadAfterImage(ai_pos)->PrevIntention();
+
+    if (!prev) {
+      // see ScanCommittedIntentions
+      const auto older = ScanCatalog(0, pos + 1);
+      return older.empty() ? 0 : older.back();
+    }
+
+    if (*prev <= pos) {
+      return *prev;
+    }
+
+    last = *prev;
+  }
+}
+
+std::vector<uint64_t> DBImpl::ScanCatalog(uint64_t first, uint64_t end)
+{
+  Snapshot snap(this, LatestRoot()->root);
+  FilteredPrefixIteratorImpl it(PREFIX_COMMITTED_INTENTION, &snap);
+
+  std::vector<uint64_t> positions;
+
+  // binary keys
+  it.Seek(CommittedIntentionKey(first + 1));
+  while (it.Valid() && it.key().size() == sizeof(uint64_t)) {
+    const auto pos = ParseCommittedIntentionKey(it.key());
+    if (pos >= end)
+      break;
+    positions.emplace_back(pos);
+    it.Next();
+  }
+
+  // decimal keys from older databases. they are never mixed with binary keys
+  // for the same position.
+  std::stringstream key;
+  key << std::setw(20) << std::setfill('0') << first + 1;
+  it.Seek(key.str());
+  std::vector<uint64_t> decimal;
+  while (it.Valid()) {
+    const auto pos = ParseCommittedIntentionKey(it.key());
+    if (pos >= end)
+      break;
+    decimal.emplace_back(pos);
+    it.Next();
+  }
+
+  if (!decimal.empty()) {
+    std::vector<uint64_t> merged;
+    std::merge(decimal.begin(), decimal.end(), positions.begin(),
+        positions.end(), std::back_inserter(merged));
+    positions.swap(merged);
+  }
+
+  return positions;
 }
 
 void DBImpl::JanitorEntry()
@@ -873,7 +1752,24 @@ void DBImpl::JanitorEntry()
     janitor_cond_.wait_for(lk, std::chrono::seconds(1));
     lk.unlock();
 
-    finished_txns_.Clean(last_intention_processed_);
+    finished_txns_.Clean(processed_.pos());
+
+    if (options_.snapshot_warning_age > 0 && logger_) {
+      const auto expired = snapshots_.expired(
+          std::chrono::seconds(options_.snapshot_warning_age));
+      for (const auto& snapshot : expired) {
+        logger_->warn("snapshot at {} held for {} ms",
+            snapshot.first, snapshot.second.count());
+      }
+
+      // iterators and transactions that keep nodes in memory after they are
+      // evicted can double the memory used by the node cache.
+      const auto pinned_bytes = cache_.PinnedBytes();
+      if (pinned_bytes > options_.node_cache_size) {
+        logger_->warn("{} bytes of evicted nodes are still held",
+            pinned_bytes);
+      }
+    }
   }
 }
 
@@ -1,8 +1,11 @@
 #pragma once
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <random>
 #include <cstring>
@@ -12,6 +15,7 @@
 #include <thread>
 #include <unordered_map>
 #include <vector>
+#include <atomic>
 #include <boost/optional.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <CivetServer.h>
@@ -25,6 +29,7 @@
 #include "snapshot.h"
 #include "transaction_impl.h"
 #include "cruzdb/db.h"
+#include "cruzdb/merge_operator.h"
 #include "db/entry_service.h"
 
 namespace cruzdb {
@@ -34,20 +39,51 @@ class DBImpl : public DB {
   // point in log from which to restore a database instance
   struct RestorePoint {
     uint64_t replay_start_pos;
+    // the newest position read while finding the restore point
+    uint64_t tail_pos;
     uint64_t after_image_pos;
-    std::shared_ptr<cruzdb_proto::AfterImage> after_image;
+    std::shared_ptr<AfterImage> after_image;
+    // set when restoring from a checkpoint
+    std::shared_ptr<cruzdb_proto::Checkpoint> checkpoint;
+    // after images already in the log for intentions that will be rolled
+    // forward: intention pos -> (after image pos, number of nodes)
+    std::map<uint64_t, std::pair<uint64_t, int>> after_images;
   };
 
   struct DBStats {
     uint64_t transactions_started = 0;
   };
 
+  // catalog keys of committed intentions are big-endian binary positions.
+  // databases created before this encoding may also contain zero padded
+  // decimal keys, which sort after all binary keys. only the bootstrap
+  // intention is still recorded in the catalog.
+  static std::string CommittedIntentionKey(uint64_t pos);
+  static uint64_t ParseCommittedIntentionKey(const zlog::Slice& key);
+
   // find the latest point in the log that can be used to restore a database
   // instance. the returned RestorePoint can be passed to the DBImpl
   // constructor. then use WaitOnIntention to wait until the database has rolled
   // the log forward.
+  //
+  // when fill is false (e.g. for a follower) holes are waited on instead of
+  // being filled, and the scan starts below the tail so it never waits on a
+  // position that hasn't been appended.
   static int FindRestorePoint(EntryService *entry_service, RestorePoint& point,
-      uint64_t& latest_intention);
+      uint64_t& latest_intention, bool fill = true);
+
+  // scan the part of the log that will be rolled forward from a restore point
+  // in parallel, collecting the primary after image of each intention. this
+  // also warms the entry cache with the intentions that will be processed.
+  static void FindRecoveryAfterImages(EntryService *entry_service,
+      size_t threads, RestorePoint& point);
+
+  // true if an intention that will be replayed when rolling forward from the
+  // restore point contains merges. intentions with after images are reused
+  // rather than replayed. an intention that will abort is also counted since
+  // that isn't known until it is processed.
+  static bool ReplaysMerges(EntryService *entry_service,
+      const RestorePoint& point);
 
   DBImpl(const Options& options, zlog::Log *log,
       const RestorePoint& point,
@@ -56,15 +92,23 @@ class DBImpl : public DB {
 
   ~DBImpl();
 
+  // wait until the intention at pos, and every intention before it, has been
+  // processed.
   void WaitOnIntention(uint64_t pos);
 
   // exported DB interface
  public:
-  Transaction *BeginTransaction() override;
+  using DB::BeginTransaction;
+  Transaction *BeginTransaction(const TransactionOptions& options) override;
   Snapshot *GetSnapshot() override;
+  Snapshot *GetSnapshotAt(uint64_t pos) override;
   void ReleaseSnapshot(Snapshot *snapshot) override;
   Iterator *NewIterator(Snapshot *snapshot) override;
+  Iterator *NewIterator() override;
+  SnapshotStats GetSnapshotStats() override;
   int Get(const zlog::Slice& key, std::string *value) override;
+  bool WaitForPosition(uint64_t pos,
+      std::chrono::microseconds timeout) override;
 
   // this is harder than it seems. any existing references might keep some
   // entries in the cache alive, like the txn processor looking at the root,
@@ -103,9 +147,27 @@ class DBImpl : public DB {
   // transaction processing
  public:
   bool CompleteTransaction(TransactionImpl *txn);
+  void CompleteTransactionAsync(TransactionImpl *txn,
+      std::function<void(bool)> callback);
+
+  // lookup a user key in a committed tree
+  int Get(NodePtr root, const zlog::Slice& key, std::string *value);
+
+  // replace the value of a user key in the tree with the result of applying
+  // the merge operand to it. returns -EINVAL, leaving the tree unchanged, if
+  // there is no merge operator or it fails.
+  int MergeValue(PersistentTree *tree, const zlog::Slice& key,
+      const zlog::Slice& operand);
 
  private:
+  // rendezvous between committing transactions and the transaction processor.
+  // waiters are registered under their transaction's token in one of several
+  // independently locked shards, so committers only contend with each other
+  // and with the processor when their tokens fall into the same shard.
   class TransactionFinder {
+   public:
+    class WaiterHandle;
+
    private:
     struct Waiter {
       Waiter() :
@@ -117,6 +179,10 @@ class DBImpl : public DB {
       bool committed;
       boost::optional<uint64_t> pos;
       std::condition_variable cond;
+      // set for asynchronous waiters. the owning handle is freed once the
+      // callback is invoked.
+      std::function<void(bool)> callback;
+      WaiterHandle *owner = nullptr;
     };
 
     struct Rendezvous {
@@ -128,25 +194,32 @@ class DBImpl : public DB {
       std::unordered_map<uint64_t, bool> results;
     };
 
+    struct Shard {
+      std::mutex lock;
+      std::unordered_map<uint64_t, Rendezvous> token_waiters;
+    };
+
    public:
     class WaiterHandle {
       Waiter waiter;
+      Shard *shard;
       std::list<Waiter*>::iterator waiter_it;
       std::unordered_map<uint64_t, Rendezvous>::iterator token_it;
       friend class TransactionFinder;
     };
 
-    TransactionFinder() {
-      std::random_device seeder;
-      txn_token_engine_ = std::mt19937_64(seeder());
-      txn_token_dist_ = std::uniform_int_distribution<uint64_t>(
-          std::numeric_limits<uint64_t>::min(),
-          std::numeric_limits<uint64_t>::max());
+    TransactionFinder() :
+      num_shards_(32)
+    {
+      for (size_t i = 0; i < num_shards_; i++) {
+        shards_.push_back(std::unique_ptr<Shard>(new Shard));
+      }
     }
 
-    uint64_t NewToken() {
-      std::lock_guard<std::mutex> lk(lock_);
-      return txn_token_dist_(txn_token_engine_);
+    // each thread draws tokens from its own generator
+    static uint64_t NewToken() {
+      thread_local std::mt19937_64 engine{std::random_device{}()};
+      return engine();
     }
 
     // register token waiter before appending intention to log
@@ -155,45 +228,155 @@ class DBImpl : public DB {
     // wait on the intention to be processed
     bool WaitOnTransaction(WaiterHandle& waiter, uint64_t intention_pos);
 
-    // the transaction processor notifies the commit/abort decision
-    void Notify(int64_t token, uint64_t intention_pos, bool committed);
+    // register an asynchronous waiter before appending the intention. the
+    // returned handle is owned by the finder.
+    WaiterHandle *AddTokenWaiter(uint64_t token,
+        std::function<void(bool)> callback);
+
+    // invoke the waiter's callback once the intention has been processed. the
+    // callback runs immediately if the decision is already known.
+    void WaitOnTransactionAsync(WaiterHandle *waiter, uint64_t intention_pos);
+
+    // the transaction processor notifies the commit/abort decision. the
+    // returned completion runs the callback of an asynchronous waiter, and
+    // should be invoked without holding any locks.
+    std::function<void()> Notify(int64_t token, uint64_t intention_pos,
+        bool committed);
 
    private:
-    std::mutex lock_;
-    std::unordered_map<uint64_t, Rendezvous> token_waiters_;
-    std::mt19937_64 txn_token_engine_;
-    std::uniform_int_distribution<uint64_t> txn_token_dist_;
+    // tokens are random, so their low bits spread them across the shards
+    Shard& shard(uint64_t token) {
+      return *shards_[token % num_shards_];
+    }
+
+    const size_t num_shards_;
+    std::vector<std::unique_ptr<Shard>> shards_;
   };
 
   void NotifyIntention(uint64_t pos);
   bool ProcessConcurrentIntention(const Intention& intention);
-  void NotifyTransaction(int64_t token, uint64_t intention_pos, bool committed);
+  bool ConflictsWithCommitted(const Intention& intention);
+  static std::string OpTreeKey(const cruzdb_proto::TransactionOp& op);
+  static std::set<std::string> ConflictKeys(const Intention& intention);
+  static bool Conflicts(const Intention& intention,
+      const std::set<std::string>& intention_keys,
+      const Intention& other_intention);
+  static bool UpdatesReadRange(const Intention& intention,
+      const Intention& other_intention);
+  std::function<void()> NotifyTransaction(int64_t token,
+      uint64_t intention_pos, bool committed);
+  bool AbortBeforeAppend(const Intention& intention);
+  uint64_t AppendTransaction(TransactionImpl *txn,
+      std::unique_ptr<Intention> intention);
   void ReplayIntention(PersistentTree *tree, const Intention& intention);
+  void RecoverIntention(const Intention& intention, uint64_t after_image_pos,
+      int num_nodes);
 
   // committed intention position cache. this is used by the transaction
   // processor to look-up the position of intentions in a conflict zone. for
   // zones that begin "not too far" in the past, a cache hit is expected. for
   // zones that begin outside the range of the cache, query the database
-  // catalog. an lru approach can be taken to integrate intention positions, but
-  // the granularity of eviction should be complete ranges rather than indvidual
-  // positions that would create a sparse index.
+  // catalog.
+  //
+  // the index holds every committed intention in a contiguous range of the
+  // log ending at the newest committed intention, as a sorted array of
+  // positions. eviction removes a block of the oldest positions at once and
+  // moves the start of the range forward, so the index is never sparse.
   class CommittedIntentionIndex {
    public:
+    explicit CommittedIntentionIndex(size_t capacity);
+
+    // every committed intention after pos will be pushed. must be called
+    // before the first push.
+    void init(uint64_t pos);
+
     void push(uint64_t pos);
 
-    // (first, last] or [X<first, last]
-    // ret.second is true if returned range is complete
+    // the after images of committed intentions <= pos have been written.
+    // only those positions are evicted, so that the oldest position known to
+    // the index can always be followed back through its after image without
+    // waiting on the after image writer.
+    void finalize(uint64_t pos);
+
+    // (first, last] or [X>first, last]
+    // ret.second is true if returned range is complete. otherwise the
+    // positions between first and the oldest returned position are unknown,
+    // and the oldest returned position has a written after image.
     std::pair<std::vector<uint64_t>, bool> range(uint64_t first,
         uint64_t last) const;
 
+    // the newest limit indexed positions <= last. used to checkpoint the
+    // index.
+    std::vector<uint64_t> positions(uint64_t last, size_t limit) const;
+
+    // the newest committed intention <= pos. ret.second is false if it is
+    // older than the index, in which case ret.first is the oldest committed
+    // intention known to the index.
+    std::pair<uint64_t, bool> floor(uint64_t pos) const;
+
    private:
-    const size_t limit_ = 1000;
-    std::set<uint64_t> index_;
+    void evict();
+
+    const size_t capacity_;
+    mutable std::mutex lock_;
+    // all committed intentions in (covered_, newest] are in index_
+    uint64_t covered_;
+    uint64_t finalized_;
+    std::deque<uint64_t> index_;
   };
 
   CommittedIntentionIndex committed_intentions_;
 
+  // the position of the newest processed intention. the position is read
+  // without locking, and publishing a position only takes a lock when
+  // threads are waiting, which are kept sorted by the position they are
+  // waiting on so that each publish wakes a prefix of them.
+  class ProcessedPosition {
+   public:
+    explicit ProcessedPosition(uint64_t pos);
+
+    uint64_t pos() const {
+      return pos_.load();
+    }
+
+    // positions are published in increasing order
+    void publish(uint64_t pos);
+
+    // returns false if the timeout expires first
+    bool wait(uint64_t pos,
+        boost::optional<std::chrono::microseconds> timeout);
+
+   private:
+    struct Waiter {
+      bool done = false;
+      std::condition_variable cond;
+    };
+
+    std::atomic<uint64_t> pos_;
+    std::atomic<size_t> num_waiters_;
+    std::mutex lock_;
+    std::multimap<uint64_t, Waiter*> waiters_;
+  };
+
+  ProcessedPosition processed_;
+
  private:
+  // committed intentions in the range (first, last), where last is a
+  // committed intention with a written after image. found by following the
+  // backpointers in after images.
+  std::vector<uint64_t> ScanCommittedIntentions(uint64_t first,
+      uint64_t last);
+
+  // committed intentions in the range (first, end) recorded in the catalog
+  // keys of the tree. only intentions committed before after images carried
+  // backpointers are recorded there.
+  std::vector<uint64_t> ScanCatalog(uint64_t first, uint64_t end);
+
+  // the newest committed intention <= pos, found by following after image
+  // backpointers from the committed intention last > pos. returns zero if
+  // there is none.
+  uint64_t FindCommittedIntention(uint64_t pos, uint64_t last);
+
   static std::string prefix_string(const std::string& prefix,
       const std::string& value) {
     auto out = prefix;
@@ -202,22 +385,26 @@ class DBImpl : public DB {
     return out;
   }
 
-  mutable std::mutex lock_;
+  // guards shutdown of the janitor
+  std::mutex lock_;
   NodeCache cache_;
-  bool stop_;
+  std::atomic<bool> stop_;
 
  public:
   std::unique_ptr<EntryService> entry_service_;
 
  private:
+  // trees of committed intentions waiting for their after images to be
+  // written
+  std::mutex lcs_trees_lock_;
   std::list<std::unique_ptr<PersistentTree>> lcs_trees_;
   std::condition_variable lcs_trees_cond_;
 
   TransactionFinder txn_finder_;
-  std::map<uint64_t, std::pair<std::condition_variable*, bool*>> waiting_on_log_entry_;
   EntryService::IntentionIterator intention_iterator_;
-  uint64_t last_intention_processed_;
-  int64_t in_flight_txn_rid_;
+  // see RestorePoint::after_images. only used by the transaction processor.
+  std::map<uint64_t, std::pair<uint64_t, int>> recovery_after_images_;
+  std::atomic<int64_t> in_flight_txn_rid_;
 
  private:
   class MetricsHandler : public CivetHandler {
@@ -274,14 +461,70 @@ class DBImpl : public DB {
   };
 
   DBStats stats() const {
-    std::lock_guard<std::mutex> lk(lock_);
-    return db_stats_;
+    DBStats db_stats;
+    db_stats.transactions_started = transactions_started_.load();
+    return db_stats;
   }
 
   FinishedTransactions finished_txns_;
 
-  NodePtr root_;
-  uint64_t root_snapshot_;
+  // the latest committed tree and the intention that produced it. a new
+  // version is published each time an intention is processed, so readers
+  // take a consistent root and snapshot without locking the database.
+  struct RootVersion {
+    RootVersion(const NodePtr& root, uint64_t snapshot) :
+      root(root),
+      snapshot(snapshot)
+    {}
+
+    NodePtr root;
+    const uint64_t snapshot;
+  };
+
+  std::shared_ptr<RootVersion> LatestRoot() const {
+    return std::atomic_load(&root_);
+  }
+
+  // only called by the thread that processes the log
+  void PublishRoot(const NodePtr& root, uint64_t snapshot) {
+    std::atomic_store(&root_, std::make_shared<RootVersion>(root, snapshot));
+  }
+
+  std::shared_ptr<RootVersion> root_;
+
+  Snapshot *NewSnapshot(const RootVersion& version);
+
+  // every snapshot handed out by the database, including those owned by
+  // iterators and read-only transactions, along with the position it reads
+  // and when it was taken.
+  class SnapshotRegistry {
+   public:
+    void add(const Snapshot *snapshot, uint64_t pos);
+    void remove(const Snapshot *snapshot);
+
+    SnapshotStats stats() const;
+
+    // snapshots held for longer than age that haven't been returned by a
+    // previous call, as (position, age) pairs.
+    std::vector<std::pair<uint64_t, std::chrono::milliseconds>>
+      expired(std::chrono::seconds age);
+
+   private:
+    struct Entry {
+      const Snapshot *snapshot;
+      uint64_t pos;
+      std::chrono::steady_clock::time_point created;
+      bool reported;
+    };
+
+    mutable std::mutex lock_;
+    // in the order snapshots were taken
+    std::list<Entry> entries_;
+    std::unordered_map<const Snapshot*, std::list<Entry>::iterator> index_;
+    std::multiset<uint64_t> positions_;
+  };
+
+  SnapshotRegistry snapshots_;
 
   void TransactionProcessorEntry();
   std::thread transaction_processor_thread_;
@@ -292,6 +535,11 @@ class DBImpl : public DB {
   void AfterImageFinalizerEntry();
   std::thread afterimage_finalizer_thread_;
 
+  void WriteCheckpoint(uint64_t intention_pos, uint64_t after_image_pos);
+
+  void FollowerEntry(uint64_t pos);
+  std::thread follower_thread_;
+
   void JanitorEntry();
   std::condition_variable janitor_cond_;
   std::thread janitor_thread_;
@@ -300,7 +548,7 @@ class DBImpl : public DB {
   CivetServer metrics_http_server_;
 #endif
   MetricsHandler metrics_handler_;
-  struct DBStats db_stats_;
+  std::atomic<uint64_t> transactions_started_;
 
   std::shared_ptr<spdlog::logger> logger_;
   Options options_;
@@ -1,22 +1,81 @@
 #include "db/entry_service.h"
 #include <iostream>
 #include "db/cruzdb.pb.h"
+#include "util/compression.h"
 
 namespace cruzdb {
 
+namespace {
+
+uint64_t fnv1a64(const std::string& data)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (const auto c : data) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+}
+
 EntryService::EntryService(const Options& options,
     Statistics *statistics, zlog::Log *log) :
   stats_(statistics),
+  follower_(options.follower),
+  compression_(CompressionTypeSupported(options.compression) ?
+      options.compression : kNoCompression),
+  compression_min_intention_size_(options.compression_min_intention_size),
+  intention_cache_(options.entry_cache_size,
+      options.intention_cache_bytes),
+  after_image_cache_(options.entry_cache_size,
+      options.after_image_entry_cache_bytes),
   log_(log),
   stop_(false),
   max_pos_(0),
-  cache_size_(options.entry_cache_size)
+  tail_read_pos_(0),
+  tail_read_limit_(0),
+  tail_read_threads_(std::max(options.tail_read_threads, (size_t)1)),
+  tail_read_window_(std::max(options.tail_read_window, (size_t)1)),
+  intention_read_parallelism_(
+      std::max(options.intention_read_parallelism, (size_t)1))
 {
 }
 
+void EntryService::OpenFileCache(const Options& options, bool reset)
+{
+  if (options.after_image_cache_path.empty()) {
+    return;
+  }
+
+  // the bootstrap intention at position 1 carries a random token, so its
+  // contents identify the log.
+  std::string data;
+  int ret = log_->Read(1, &data);
+  if (ret) {
+    std::cerr << "after image cache disabled: read log id ret "
+      << ret << std::endl;
+    return;
+  }
+
+  ret = AfterImageFileCache::Open(options.after_image_cache_path,
+      options.after_image_cache_size, fnv1a64(data), reset, &file_cache_);
+  if (ret) {
+    std::cerr << "after image cache disabled: open "
+      << options.after_image_cache_path << " ret " << ret << std::endl;
+  }
+}
+
 void EntryService::Start(uint64_t pos)
 {
+  assert(pos > 0);
+  ai_matcher.init(pos - 1);
   pos_ = pos;
+  tail_read_pos_ = pos;
+  tail_read_limit_ = pos;
+  for (size_t i = 0; i < tail_read_threads_; i++) {
+    tail_readers_.emplace_back(&EntryService::TailReaderEntry, this);
+  }
   io_thread_ = std::thread(&EntryService::IOEntry, this);
 }
 
@@ -34,18 +93,141 @@ void EntryService::Stop()
     for (auto& cond : tail_waiters_) {
       cond->notify_one();
     }
+    tail_read_cond_.notify_all();
+    tail_ready_cond_.notify_one();
   }
 
   io_thread_.join();
+  for (auto& reader : tail_readers_) {
+    reader.join();
+  }
+}
+
+EntryService::EntryCache::EntryCache(size_t slots, size_t max_bytes) :
+  slots_(std::max(slots, (size_t)1)),
+  max_bytes_(max_bytes),
+  bytes_(0)
+{
+}
+
+boost::optional<EntryService::CacheEntry>
+EntryService::EntryCache::Lookup(uint64_t pos) const
+{
+  const auto s = std::atomic_load(&slots_[pos % slots_.size()]);
+  if (s && s->pos == pos) {
+    return s->entry;
+  }
+  return boost::none;
+}
+
+void EntryService::EntryCache::set_slot(std::shared_ptr<const Slot>& slot,
+    std::shared_ptr<const Slot> next)
+{
+  auto curr = std::atomic_load(&slot);
+  if (curr) {
+    bytes_ -= curr->bytes;
+  }
+  if (next) {
+    bytes_ += next->bytes;
+  }
+  std::atomic_store(&slot, std::move(next));
+}
+
+EntryService::CacheEntry EntryService::EntryCache::Insert(uint64_t pos,
+    const CacheEntry& entry, size_t bytes)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+
+  auto& s = slot(pos);
+  const auto curr = std::atomic_load(&s);
+  if (curr && curr->pos >= pos) {
+    return curr->pos == pos ? curr->entry : entry;
+  }
+
+  // an entry larger than the budget is returned to the caller uncached.
+  // installing it would leave the cache over budget until its slot is reused.
+  if (bytes > max_bytes_) {
+    return entry;
+  }
+
+  set_slot(s, std::make_shared<const Slot>(Slot{pos, bytes, entry}));
+  fifo_.push_back(pos);
+
+  // the fifo may hold positions that were since replaced in their slot. it
+  // is trimmed to the number of slots so that it doesn't grow without bound
+  // when the cache stays under budget.
+  while ((bytes_ > max_bytes_ || fifo_.size() > slots_.size()) &&
+      !fifo_.empty()) {
+    const auto victim = fifo_.front();
+    fifo_.pop_front();
+    auto& vs = slot(victim);
+    const auto v = std::atomic_load(&vs);
+    if (v && v->pos == victim) {
+      set_slot(vs, nullptr);
+    }
+  }
+
+  return entry;
 }
 
-void EntryService::entry_cache_gc()
+void EntryService::EntryCache::Erase(uint64_t pos)
 {
-  while (entry_cache_.size() > cache_size_) {
-    entry_cache_.erase(entry_cache_.begin());
+  std::lock_guard<std::mutex> lk(lock_);
+  auto& s = slot(pos);
+  const auto curr = std::atomic_load(&s);
+  if (curr && curr->pos == pos) {
+    set_slot(s, nullptr);
   }
 }
 
+void EntryService::EntryCache::Clear()
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  for (auto& s : slots_) {
+    set_slot(s, nullptr);
+  }
+  fifo_.clear();
+}
+
+boost::optional<EntryService::CacheEntry>
+EntryService::CacheLookup(uint64_t pos) const
+{
+  auto entry = intention_cache_.Lookup(pos);
+  if (entry) {
+    return entry;
+  }
+  return after_image_cache_.Lookup(pos);
+}
+
+EntryService::CacheEntry EntryService::CacheInsert(uint64_t pos,
+    const CacheEntry& entry)
+{
+  switch (entry.type) {
+    case CacheEntry::EntryType::INTENTION:
+      return intention_cache_.Insert(pos, entry, entry.intention->ByteSize());
+
+    case CacheEntry::EntryType::FILLED:
+      return intention_cache_.Insert(pos, entry, 0);
+
+    case CacheEntry::EntryType::AFTERIMAGE:
+      return after_image_cache_.Insert(pos, entry,
+          entry.after_image->ByteSize());
+
+    case CacheEntry::EntryType::CHECKPOINT:
+      return after_image_cache_.Insert(pos, entry,
+          entry.checkpoint->ByteSizeLong());
+
+    default:
+      assert(0);
+      exit(1);
+  }
+}
+
+void EntryService::ReleaseAfterImage(uint64_t pos)
+{
+  after_image_cache_.Erase(pos);
+}
+
 void EntryService::IOEntry()
 {
   uint64_t next = pos_;
@@ -62,71 +244,42 @@ void EntryService::IOEntry()
       std::this_thread::sleep_for(std::chrono::microseconds(1000));
       continue;
     }
-    while (next < tail) {
-      std::unique_lock<std::mutex> lk(lock_);
-      auto it = entry_cache_.find(next);
-      if (it == entry_cache_.end()) {
-        lk.unlock();
-        std::string data;
-        int ret = log_->Read(next, &data);
-        if (ret) {
-          if (ret == -ENOENT) {
-            // we aren't going to spin on the tail, but we haven't yet implemented
-            // a fill policy, and really we shouldn't have holes in our
-            // single-node setup, so we just spin on the hole for now...
-            continue;
-          } else if (ret == -ENODATA) {
-            break;
-          }
-          assert(0);
-        }
 
-        CacheEntry cache_entry;
+    std::unique_lock<std::mutex> lk(lock_);
+    while (next < tail && !stop_) {
+      // slide the window forward as entries are published so that the
+      // readers stay busy while we wait on the oldest outstanding position.
+      const auto limit = std::min(tail, next + tail_read_window_);
+      if (limit > tail_read_limit_) {
+        tail_read_limit_ = limit;
+        tail_read_cond_.notify_all();
+      }
 
-        if (ret == 0) {
-          RecordTick(stats_, LOG_READS);
-          RecordTick(stats_, BYTES_READ, data.size());
-
-          cruzdb_proto::LogEntry entry;
-          assert(entry.ParseFromString(data));
-          assert(entry.IsInitialized());
-
-          switch (entry.type()) {
-            case cruzdb_proto::LogEntry::AFTER_IMAGE:
-              cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
-              cache_entry.after_image =
-                std::make_shared<cruzdb_proto::AfterImage>(
-                    std::move(entry.after_image()));
-              ai_matcher.push(entry.after_image(), next);
-              break;
-
-            case cruzdb_proto::LogEntry::INTENTION:
-              cache_entry.type = CacheEntry::EntryType::INTENTION;
-              cache_entry.intention = std::make_shared<Intention>(
-                  entry.intention(), next);
-              break;
-
-            default:
-              assert(0);
-              exit(1);
-          }
-        } else if (ret == -ENODATA) {
-          cache_entry.type = CacheEntry::EntryType::FILLED;
-          RecordTick(stats_, LOG_READS_FILLED);
-        } else {
-          std::cout << "terrible" << std::endl;
-          assert(0);
-          exit(1);
+      tail_ready_cond_.wait(lk, [&] {
+        return stop_ || tail_ready_.find(next) != tail_ready_.end();
+      });
+
+      if (stop_)
+        break;
+
+      auto it = tail_ready_.find(next);
+      auto entry = std::move(it->second);
+      tail_ready_.erase(it);
+
+      if (entry) {
+        // the matcher de-duplicates after images by keeping the first one in
+        // the log, so they are pushed in log order.
+        if (entry->type == CacheEntry::EntryType::AFTERIMAGE && !follower_) {
+          lk.unlock();
+          ai_matcher.push(*entry->after_image, next);
+          lk.lock();
         }
 
-        lk.lock();
-        entry_cache_.emplace(next, cache_entry);
-        entry_cache_gc();
+        CacheInsert(next, *entry);
         max_pos_ = std::max(max_pos_, next);
         for (auto& cond : tail_waiters_) {
           cond->notify_one();
         }
-        lk.unlock();
       }
 
       next++;
@@ -134,6 +287,108 @@ void EntryService::IOEntry()
   }
 }
 
+void EntryService::TailReaderEntry()
+{
+  while (true) {
+    std::unique_lock<std::mutex> lk(lock_);
+    tail_read_cond_.wait(lk, [&] {
+      return stop_ || tail_read_pos_ < tail_read_limit_;
+    });
+
+    if (stop_)
+      break;
+
+    const auto pos = tail_read_pos_++;
+    lk.unlock();
+
+    auto entry = ReadTailEntry(pos);
+
+    lk.lock();
+    if (stop_)
+      break;
+    tail_ready_.emplace(pos, std::move(entry));
+    tail_ready_cond_.notify_one();
+  }
+}
+
+boost::optional<EntryService::CacheEntry>
+EntryService::ReadTailEntry(uint64_t pos)
+{
+  if (CacheLookup(pos)) {
+    return boost::none;
+  }
+
+  CacheEntry cache_entry;
+
+  auto cached_after_image = FileCacheLookup(pos);
+  if (cached_after_image) {
+    cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
+    cache_entry.after_image = cached_after_image;
+    return cache_entry;
+  }
+
+  std::string data;
+  int delay = 1;
+  while (true) {
+    int ret = log_->Read(pos, &data);
+    if (ret == 0) {
+      break;
+    } else if (ret == -ENODATA) {
+      cache_entry.type = CacheEntry::EntryType::FILLED;
+      RecordTick(stats_, LOG_READS_FILLED);
+      return cache_entry;
+    } else if (ret == -ENOENT) {
+      // we haven't yet implemented a fill policy, and really we shouldn't
+      // have holes in our single-node setup, so we just wait on the hole for
+      // now...
+      {
+        std::lock_guard<std::mutex> lk(lock_);
+        if (stop_)
+          return boost::none;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(delay));
+      delay = std::min(delay*10, 1000);
+      continue;
+    }
+    std::cout << "terrible" << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  RecordTick(stats_, LOG_READS);
+  RecordTick(stats_, BYTES_READ, data.size());
+
+  cruzdb_proto::LogEntry entry;
+  ParseEntry(data, entry);
+
+  switch (entry.type()) {
+    case cruzdb_proto::LogEntry::AFTER_IMAGE:
+      cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
+      cache_entry.after_image = TakeAfterImage(entry);
+      FileCacheInsert(pos, *cache_entry.after_image);
+      break;
+
+    case cruzdb_proto::LogEntry::INTENTION:
+      cache_entry.type = CacheEntry::EntryType::INTENTION;
+      cache_entry.intention = std::make_shared<Intention>(
+          entry.intention(), pos);
+      break;
+
+    case cruzdb_proto::LogEntry::CHECKPOINT:
+      cache_entry.type = CacheEntry::EntryType::CHECKPOINT;
+      cache_entry.checkpoint =
+        std::make_shared<cruzdb_proto::Checkpoint>(
+            std::move(*entry.mutable_checkpoint()));
+      break;
+
+    default:
+      assert(0);
+      exit(1);
+  }
+
+  return cache_entry;
+}
+
 EntryService::Iterator::Iterator(
     EntryService *entry_service, uint64_t pos, const std::string& name) :
   pos_(pos),
@@ -206,7 +461,7 @@ EntryService::AfterImageIterator::AfterImageIterator(
 }
 
 boost::optional<
-std::pair<uint64_t, std::shared_ptr<cruzdb_proto::AfterImage>>>
+std::pair<uint64_t, std::shared_ptr<AfterImage>>>
 EntryService::AfterImageIterator::Next()
 {
   while (true) {
@@ -241,17 +496,16 @@ EntryService::NewAfterImageIterator(uint64_t pos)
 
 boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool fill)
 {
-  std::unique_lock<std::mutex> lk(lock_);
-
   // check cache for target position
-  auto it = entry_cache_.find(pos);
-  if (it != entry_cache_.end()) {
+  auto cached = CacheLookup(pos);
+  if (cached) {
     RecordTick(stats_, LOG_READ_CACHE_HIT);
-    return it->second;
+    return cached;
   }
 
   // if position is larger than any added to the cache so far, wait to be
   // notified when the position has been read by the log scanner.
+  std::unique_lock<std::mutex> lk(lock_);
   if (pos > max_pos_) {
     std::condition_variable cond;
     tail_waiters_.emplace_back(&cond);
@@ -261,14 +515,31 @@ boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool
     tail_waiters_.erase(cit);
     if (stop_)
       return boost::none;
+
+    lk.unlock();
+
+    cached = CacheLookup(pos);
+    if (cached) {
+      RecordTick(stats_, LOG_READ_CACHE_HIT);
+      return cached;
+    }
+  } else {
+    lk.unlock();
   }
 
-  lk.unlock();
+  auto cached_after_image = FileCacheLookup(pos);
+  if (cached_after_image) {
+    CacheEntry cache_entry;
+    cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
+    cache_entry.after_image = cached_after_image;
+    return CacheInsert(pos, cache_entry);
+  }
 
   // mm... still we see an occasional hole that should be temporary in the
   // current setups. this tight loop is bad. we'll be moving to a different way
   // to do io retries and filling later...
   std::string data;
+  int delay = 1;
   while (true) {
     int ret = log_->Read(pos, &data);
     if (ret) {
@@ -276,15 +547,21 @@ boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool
         CacheEntry cache_entry;
         cache_entry.type = CacheEntry::EntryType::FILLED;
         RecordTick(stats_, LOG_READS_FILLED);
-        lk.lock();
-        auto p = entry_cache_.emplace(pos, cache_entry);
-        entry_cache_gc();
-        return p.first->second;
+        return CacheInsert(pos, cache_entry);
       } else if (ret == -ENOENT) {
         RecordTick(stats_, LOG_READS_UNWRITTEN);
         if (fill) {
           ret = log_->Fill(pos);
           assert(ret == 0 || ret == -EROFS);
+        } else {
+          // wait for the position to be written with increasing delay
+          {
+            std::lock_guard<std::mutex> l(lock_);
+            if (stop_)
+              return boost::none;
+          }
+          std::this_thread::sleep_for(std::chrono::microseconds(delay));
+          delay = std::min(delay*10, 1000);
         }
         continue;
       }
@@ -299,17 +576,15 @@ boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool
   RecordTick(stats_, BYTES_READ, data.size());
 
   cruzdb_proto::LogEntry entry;
-  assert(entry.ParseFromString(data));
-  assert(entry.IsInitialized());
+  ParseEntry(data, entry);
 
   CacheEntry cache_entry;
 
   switch (entry.type()) {
     case cruzdb_proto::LogEntry::AFTER_IMAGE:
       cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
-      cache_entry.after_image =
-        std::make_shared<cruzdb_proto::AfterImage>(
-            std::move(entry.after_image()));
+      cache_entry.after_image = TakeAfterImage(entry);
+      FileCacheInsert(pos, *cache_entry.after_image);
       break;
 
     case cruzdb_proto::LogEntry::INTENTION:
@@ -318,16 +593,18 @@ boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool
           entry.intention(), pos);
       break;
 
+    case cruzdb_proto::LogEntry::CHECKPOINT:
+      cache_entry.type = CacheEntry::EntryType::CHECKPOINT;
+      cache_entry.checkpoint = std::make_shared<cruzdb_proto::Checkpoint>(
+          std::move(*entry.mutable_checkpoint()));
+      break;
+
     default:
       assert(0);
       exit(1);
   }
 
-  lk.lock();
-
-  auto p = entry_cache_.emplace(pos, cache_entry);
-  entry_cache_gc();
-  return p.first->second;
+  return CacheInsert(pos, cache_entry);
 }
 
 EntryService::PrimaryAfterImageMatcher::PrimaryAfterImageMatcher() :
@@ -364,11 +641,11 @@ void EntryService::PrimaryAfterImageMatcher::watch(
 }
 
 void EntryService::PrimaryAfterImageMatcher::push(
-    const cruzdb_proto::AfterImage& ai, uint64_t pos)
+    const AfterImage& ai, uint64_t pos)
 {
   std::lock_guard<std::mutex> lk(lock_);
 
-  const auto ipos = ai.intention();
+  const auto ipos = ai.Intention();
   if (ipos <= matched_watermark_) {
     return;
   }
@@ -387,6 +664,33 @@ void EntryService::PrimaryAfterImageMatcher::push(
   gc();
 }
 
+void EntryService::PrimaryAfterImageMatcher::init(uint64_t watermark)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  assert(afterimages_.empty());
+  matched_watermark_ = watermark;
+}
+
+void EntryService::PrimaryAfterImageMatcher::skip(uint64_t intention_pos)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+
+  if (intention_pos <= matched_watermark_) {
+    return;
+  }
+
+  auto it = afterimages_.find(intention_pos);
+  if (it == afterimages_.end()) {
+    afterimages_.emplace(intention_pos,
+        PrimaryAfterImage{boost::none, nullptr, {}});
+  } else {
+    assert(!it->second.tree);
+    it->second.pos = boost::none;
+  }
+
+  gc();
+}
+
 std::pair<std::vector<SharedNodeRef>,
   std::unique_ptr<PersistentTree>>
 EntryService::PrimaryAfterImageMatcher::match()
@@ -488,6 +792,138 @@ uint64_t EntryService::Append(const std::string& data) const
   }
 }
 
+void EntryService::CompressEntry(cruzdb_proto::LogEntry::EntryType type,
+    std::string& blob) const
+{
+  if (compression_ == kNoCompression) {
+    return;
+  }
+
+  if (type == cruzdb_proto::LogEntry::INTENTION &&
+      blob.size() < compression_min_intention_size_) {
+    return;
+  }
+
+  std::string compressed;
+  if (!Compress(compression_, blob, &compressed) ||
+      compressed.size() >= blob.size()) {
+    return;
+  }
+
+  cruzdb_proto::LogEntry entry;
+  entry.set_type(type);
+  switch (compression_) {
+    case kLZ4Compression:
+      entry.set_compression(cruzdb_proto::LogEntry::LZ4);
+      break;
+    case kZSTDCompression:
+      entry.set_compression(cruzdb_proto::LogEntry::ZSTD);
+      break;
+    default:
+      assert(0);
+      exit(1);
+  }
+  entry.set_uncompressed_size(blob.size());
+  entry.set_compressed_entry(std::move(compressed));
+  assert(entry.IsInitialized());
+
+  RecordTick(stats_, BYTES_UNCOMPRESSED, blob.size());
+
+  blob.clear();
+  if (!entry.SerializeToString(&blob)) {
+    std::cerr << "failed to serialize log entry" << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  RecordTick(stats_, BYTES_COMPRESSED, blob.size());
+}
+
+void EntryService::ParseEntry(const std::string& data,
+    cruzdb_proto::LogEntry& entry) const
+{
+  if (!entry.ParseFromString(data)) {
+    std::cerr << "failed to parse log entry" << std::endl;
+    assert(0);
+    exit(1);
+  }
+  assert(entry.IsInitialized());
+
+  if (entry.compression() == cruzdb_proto::LogEntry::NONE) {
+    return;
+  }
+
+  CompressionType type;
+  switch (entry.compression()) {
+    case cruzdb_proto::LogEntry::LZ4:
+      type = kLZ4Compression;
+      break;
+    case cruzdb_proto::LogEntry::ZSTD:
+      type = kZSTDCompression;
+      break;
+    default:
+      std::cerr << "unknown log entry compression" << std::endl;
+      assert(0);
+      exit(1);
+  }
+
+  std::string uncompressed;
+  if (!Uncompress(type, entry.compressed_entry(),
+        entry.uncompressed_size(), &uncompressed)) {
+    std::cerr << "failed to decompress log entry" << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  RecordTick(stats_, BYTES_DECOMPRESSED, uncompressed.size());
+
+  const auto type_check = entry.type();
+  entry.Clear();
+  if (!entry.ParseFromString(uncompressed)) {
+    std::cerr << "failed to parse log entry" << std::endl;
+    assert(0);
+    exit(1);
+  }
+  assert(entry.IsInitialized());
+  assert(entry.type() == type_check);
+  assert(entry.compression() == cruzdb_proto::LogEntry::NONE);
+}
+
+std::shared_ptr<AfterImage> EntryService::FileCacheLookup(uint64_t pos)
+{
+  if (!file_cache_) {
+    return nullptr;
+  }
+
+  auto after_image = file_cache_->Lookup(pos);
+  if (after_image) {
+    RecordTick(stats_, AFTER_IMAGE_FILE_CACHE_HIT);
+  }
+
+  return after_image;
+}
+
+void EntryService::FileCacheInsert(uint64_t pos,
+    const AfterImage& after_image)
+{
+  if (file_cache_) {
+    RecordTick(stats_, AFTER_IMAGE_FILE_CACHE_MISS);
+    file_cache_->Insert(pos, after_image);
+  }
+}
+
+std::shared_ptr<AfterImage> EntryService::TakeAfterImage(
+    cruzdb_proto::LogEntry& entry)
+{
+  assert(entry.type() == cruzdb_proto::LogEntry::AFTER_IMAGE);
+  if (entry.has_flat_after_image()) {
+    return std::make_shared<AfterImage>(
+        std::move(*entry.mutable_flat_after_image()));
+  }
+  return std::make_shared<AfterImage>(
+      std::move(*entry.mutable_after_image()));
+}
+
 uint64_t EntryService::Append(cruzdb_proto::Intention& intention) const
 {
   cruzdb_proto::LogEntry entry;
@@ -499,26 +935,54 @@ uint64_t EntryService::Append(cruzdb_proto::Intention& intention) const
   assert(entry.SerializeToString(&blob));
   entry.release_intention();
 
+  CompressEntry(cruzdb_proto::LogEntry::INTENTION, blob);
+
   return Append(blob);
 }
 
-uint64_t EntryService::Append(cruzdb_proto::AfterImage& after_image) const
+uint64_t EntryService::Append(AfterImageBuilder& after_image) const
 {
   cruzdb_proto::LogEntry entry;
-  entry.set_type(cruzdb_proto::LogEntry::AFTER_IMAGE);
-  entry.set_allocated_after_image(&after_image);
+  after_image.Finish(entry);
   assert(entry.IsInitialized());
 
   std::string blob;
-  assert(entry.SerializeToString(&blob));
-  entry.release_after_image();
+  if (!entry.SerializeToString(&blob)) {
+    std::cerr << "failed to serialize after image" << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  CompressEntry(cruzdb_proto::LogEntry::AFTER_IMAGE, blob);
+
+  return Append(blob);
+}
+
+uint64_t EntryService::Append(cruzdb_proto::Checkpoint& checkpoint) const
+{
+  cruzdb_proto::LogEntry entry;
+  entry.set_type(cruzdb_proto::LogEntry::CHECKPOINT);
+  entry.set_allocated_checkpoint(&checkpoint);
+  assert(entry.IsInitialized());
+
+  std::string blob;
+  const bool ok = entry.SerializeToString(&blob);
+  entry.release_checkpoint();
+  if (!ok) {
+    std::cerr << "failed to serialize checkpoint" << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  CompressEntry(cruzdb_proto::LogEntry::CHECKPOINT, blob);
 
   return Append(blob);
 }
 
 uint64_t EntryService::Append(std::unique_ptr<Intention> intention)
 {
-  const auto blob = intention->Serialize();
+  auto blob = intention->Serialize();
+  CompressEntry(cruzdb_proto::LogEntry::INTENTION, blob);
 
   const auto pos = Append(blob);
   intention->SetPosition(pos);
@@ -527,9 +991,9 @@ uint64_t EntryService::Append(std::unique_ptr<Intention> intention)
   cache_entry.type = CacheEntry::EntryType::INTENTION;
   cache_entry.intention = std::move(intention);
 
+  CacheInsert(pos, cache_entry);
+
   std::lock_guard<std::mutex> lk(lock_);
-  entry_cache_.emplace(pos, cache_entry);
-  entry_cache_gc();
   max_pos_ = std::max(max_pos_, pos);
   for (auto& cond : tail_waiters_) {
     cond->notify_one();
@@ -538,21 +1002,25 @@ uint64_t EntryService::Append(std::unique_ptr<Intention> intention)
   return pos;
 }
 
-std::shared_ptr<cruzdb_proto::AfterImage>
+std::shared_ptr<AfterImage>
 EntryService::ReadAfterImage(const uint64_t pos)
 {
-  std::unique_lock<std::mutex> lk(lock_);
-
   // check for afterimage in the cache
-  auto it = entry_cache_.find(pos);
-  if (it != entry_cache_.end()) {
-    assert(it->second.type ==
+  auto cached = CacheLookup(pos);
+  if (cached) {
+    assert(cached->type ==
         CacheEntry::EntryType::AFTERIMAGE);
     RecordTick(stats_, LOG_READ_CACHE_HIT);
-    return it->second.after_image;
+    return cached->after_image;
   }
 
-  lk.unlock();
+  auto cached_after_image = FileCacheLookup(pos);
+  if (cached_after_image) {
+    CacheEntry cache_entry;
+    cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
+    cache_entry.after_image = cached_after_image;
+    return CacheInsert(pos, cache_entry).after_image;
+  }
 
   int delay = 1;
   while (true) {
@@ -577,16 +1045,14 @@ EntryService::ReadAfterImage(const uint64_t pos)
     RecordTick(stats_, BYTES_READ, data.size());
 
     cruzdb_proto::LogEntry entry;
-    assert(entry.ParseFromString(data));
-    assert(entry.IsInitialized());
+    ParseEntry(data, entry);
 
     CacheEntry cache_entry;
     switch (entry.type()) {
       case cruzdb_proto::LogEntry::AFTER_IMAGE:
         cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
-        cache_entry.after_image =
-          std::make_shared<cruzdb_proto::AfterImage>(
-              std::move(entry.after_image()));
+        cache_entry.after_image = TakeAfterImage(entry);
+        FileCacheInsert(pos, *cache_entry.after_image);
         break;
 
       case cruzdb_proto::LogEntry::INTENTION:
@@ -597,112 +1063,97 @@ EntryService::ReadAfterImage(const uint64_t pos)
     }
 
     // insert entry into the cache
-    lk.lock();
-    auto p = entry_cache_.emplace(pos, cache_entry);
-    entry_cache_gc();
-    assert(p.first->second.type ==
+    auto inserted = CacheInsert(pos, cache_entry);
+    assert(inserted.type ==
         CacheEntry::EntryType::AFTERIMAGE);
-    return p.first->second.after_image;
+    return inserted.after_image;
   }
 }
 
 std::vector<std::shared_ptr<Intention>>
 EntryService::ReadIntentions(const std::vector<uint64_t>& positions)
 {
-  std::vector<std::shared_ptr<Intention>> intentions;
-  std::vector<uint64_t> missing_positions;
+  std::vector<std::shared_ptr<Intention>> intentions(positions.size());
+  std::vector<size_t> missing;
 
   // check cache
-  std::unique_lock<std::mutex> lk(lock_);
-  for (const auto pos : positions) {
-    auto it = entry_cache_.find(pos);
-    if (it != entry_cache_.end()) {
-      assert(it->second.type == CacheEntry::EntryType::INTENTION);
+  for (size_t i = 0; i < positions.size(); i++) {
+    auto cached = CacheLookup(positions[i]);
+    if (cached) {
+      assert(cached->type == CacheEntry::EntryType::INTENTION);
       RecordTick(stats_, LOG_READ_CACHE_HIT);
-      intentions.emplace_back(it->second.intention);
+      intentions[i] = cached->intention;
     } else {
-      missing_positions.emplace_back(pos);
+      missing.emplace_back(i);
     }
   }
-  lk.unlock();
 
-  // dispatch async reads. we'll want to throttle this later in some way to deal
-  // with large requests for now the sizes seem reasonable.
-  std::vector<zlog::AioCompletion*> ios;
-  std::vector<std::string> blobs(missing_positions.size());
-  for (size_t i = 0; i < missing_positions.size(); i++) {
-    auto *c = zlog::Log::aio_create_completion();
-    ios.emplace_back(c);
-    int ret = log_->AioRead(missing_positions[i], c, &blobs[i]);
-    assert(ret == 0);
-  }
-
-  // wait for completions, and optional dispatch any retries
+  // keep a bounded number of async reads in flight. completions are handled
+  // in dispatch order, and each one is parsed while the reads behind it are
+  // still outstanding, so parsing overlaps with the remaining I/O. a deque is
+  // used because the read buffers must not move while a read is in flight.
+  struct PendingRead {
+    size_t index;
+    zlog::AioCompletion *c;
+    std::string blob;
+  };
+
+  std::deque<PendingRead> inflight;
+  size_t next = 0;
   int delay = 1;
-  while (true) {
-    bool done = true;
-    for (size_t i = 0; i < ios.size(); i++) {
-      auto c = ios[i];
-      if (c) {
-        c->WaitForComplete();
-        int ioret = c->ReturnValue();
-        if (ioret == 0) {
-          ios[i] = nullptr;
-          RecordTick(stats_, LOG_READS);
-          RecordTick(stats_, BYTES_READ, blobs[i].size());
-        } else if (ioret == -ENODATA) {
-          std::cerr << "unexpected log entry" << std::endl;
-          assert(0);
-          exit(1);
-        } else {
-          done = false;
-        }
-        delete c;
-      }
+
+  while (next < missing.size() || !inflight.empty()) {
+    while (next < missing.size() &&
+        inflight.size() < intention_read_parallelism_) {
+      inflight.emplace_back();
+      auto& read = inflight.back();
+      read.index = missing[next++];
+      read.c = zlog::Log::aio_create_completion();
+      int ret = log_->AioRead(positions[read.index], read.c, &read.blob);
+      assert(ret == 0);
     }
 
-    if (done)
-      break;
+    auto& read = inflight.front();
+    read.c->WaitForComplete();
+    int ioret = read.c->ReturnValue();
+    delete read.c;
+    read.c = nullptr;
 
-    std::cerr << "batch reads failed, delay retry" << std::endl;
-    std::this_thread::sleep_for(std::chrono::milliseconds(delay));
-    delay = std::min(delay*10, 1000);
+    if (ioret == -ENODATA) {
+      std::cerr << "unexpected log entry" << std::endl;
+      assert(0);
+      exit(1);
+    } else if (ioret) {
+      std::cerr << "batch read failed, delay retry" << std::endl;
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+      delay = std::min(delay*10, 1000);
 
-    for (size_t i = 0; i < ios.size(); i++) {
-      auto c = ios[i];
-      if (c) { // c is not valid, just a non-null flag
-        auto *c = zlog::Log::aio_create_completion();
-        ios[i] = c;
-        int ret = log_->AioRead(missing_positions[i], c, &blobs[i]);
-        assert(ret == 0);
-      }
+      read.c = zlog::Log::aio_create_completion();
+      int ret = log_->AioRead(positions[read.index], read.c, &read.blob);
+      assert(ret == 0);
+      continue;
     }
-  }
 
-  for (size_t i = 0; i < blobs.size(); i++) {
+    RecordTick(stats_, LOG_READS);
+    RecordTick(stats_, BYTES_READ, read.blob.size());
+
     cruzdb_proto::LogEntry entry;
-    assert(entry.ParseFromString(blobs[i]));
-    assert(entry.IsInitialized());
+    ParseEntry(read.blob, entry);
     assert(entry.type() == cruzdb_proto::LogEntry::INTENTION);
 
-    // more efficient to use the interface in c++17 that doesn't construct the
-    // element being inserted into the cache unless it is being inserted.
-    auto intention = std::make_shared<Intention>(
-        entry.intention(), missing_positions[i]);
+    const auto pos = positions[read.index];
 
     CacheEntry cache_entry;
     cache_entry.type = CacheEntry::EntryType::INTENTION;
-    cache_entry.intention = intention;
+    cache_entry.intention = std::make_shared<Intention>(
+        entry.intention(), pos);
 
-    lk.lock();
-    auto p = entry_cache_.emplace(missing_positions[i], cache_entry);
-    entry_cache_gc();
-    intentions.emplace_back(p.first->second.intention);
-    lk.unlock();
+    intentions[read.index] = CacheInsert(pos, cache_entry).intention;
+
+    inflight.pop_front();
   }
 
-  assert(intentions.size() == positions.size());
-  return std::move(intentions);
+  return intentions;
 }
 
 }
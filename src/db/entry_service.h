@@ -1,13 +1,17 @@
 #pragma once
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <boost/optional.hpp>
 #include <zlog/log.h>
 #include "cruzdb/options.h"
+#include "db/after_image.h"
+#include "db/after_image_file_cache.h"
 #include "db/persistent_tree.h"
 #include "db/intention.h"
 #include "monitoring/statistics.h"
@@ -25,6 +29,11 @@ class EntryService {
   void Start(uint64_t pos);
   void Stop();
 
+  // open the after image file cache when one is configured. the cache is tied
+  // to the log by the bootstrap entry, so this is called once the log has been
+  // initialized, with reset set when the database was just created.
+  void OpenFileCache(const Options& options, bool reset);
+
  public:
   // matches intentions with their primary afterimage in the log
   class PrimaryAfterImageMatcher {
@@ -48,7 +57,17 @@ class EntryService {
         std::unique_ptr<PersistentTree> intention);
 
     // add an afterimage from the log
-    void push(const cruzdb_proto::AfterImage& ai, uint64_t pos);
+    void push(const AfterImage& ai, uint64_t pos);
+
+    // intentions at or below the watermark will never be watched. this is set
+    // before the log is scanned so that after images of intentions that are
+    // already part of the restored state don't accumulate in the index.
+    void init(uint64_t watermark);
+
+    // mark an intention as matched without watching it. used when recovery
+    // reuses an after image that is already in the log. the same ordering
+    // rules as watch apply.
+    void skip(uint64_t intention_pos);
 
     // get intention/afterimage match
     std::pair<
@@ -92,12 +111,14 @@ class EntryService {
     enum EntryType {
       INTENTION,
       AFTERIMAGE,
+      CHECKPOINT,
       FILLED
     };
 
     EntryType type;
     std::shared_ptr<Intention> intention;
-    std::shared_ptr<cruzdb_proto::AfterImage> after_image;
+    std::shared_ptr<AfterImage> after_image;
+    std::shared_ptr<cruzdb_proto::Checkpoint> checkpoint;
   };
 
   class Iterator {
@@ -144,7 +165,7 @@ class EntryService {
    public:
     AfterImageIterator(EntryService *entry_service, uint64_t pos);
     boost::optional<std::pair<uint64_t,
-      std::shared_ptr<cruzdb_proto::AfterImage>>> Next();
+      std::shared_ptr<AfterImage>>> Next();
   };
 
   ReverseIterator NewReverseIterator(uint64_t pos, const std::string& name);
@@ -152,16 +173,17 @@ class EntryService {
   AfterImageIterator NewAfterImageIterator(uint64_t pos);
 
   uint64_t Append(cruzdb_proto::Intention& intention) const;
-  uint64_t Append(cruzdb_proto::AfterImage& after_image) const;
+  uint64_t Append(AfterImageBuilder& after_image) const;
+  uint64_t Append(cruzdb_proto::Checkpoint& checkpoint) const;
   uint64_t Append(std::unique_ptr<Intention> intention);
 
   // Read an afterimage at the provided position. It is a fatal error if the log
   // does not contain an afterimage at the position.
-  std::shared_ptr<cruzdb_proto::AfterImage>
-    ReadAfterImage(const uint64_t pos);
+  std::shared_ptr<AfterImage> ReadAfterImage(const uint64_t pos);
 
   // Read intentions at the provided positions. It is a fatal error if any
-  // position does not contain an intention.
+  // position does not contain an intention. Intentions are returned in the
+  // order of their positions, and uncached intentions are read concurrently.
   std::vector<std::shared_ptr<Intention>> ReadIntentions(
       const std::vector<uint64_t>& positions);
 
@@ -171,9 +193,13 @@ class EntryService {
 
   void Fill(uint64_t pos) const;
 
+  // drop a cached after image once its nodes have been absorbed into the node
+  // cache, where they will be found by later reads.
+  void ReleaseAfterImage(uint64_t pos);
+
   void ClearCaches() {
-    std::unique_lock<std::mutex> lk(lock_);
-    entry_cache_.clear();
+    intention_cache_.Clear();
+    after_image_cache_.Clear();
   }
 
  private:
@@ -182,11 +208,97 @@ class EntryService {
   void IOEntry();
   uint64_t Append(const std::string& data) const;
 
-  // this still needs a lot of work. we are just removing older log entries, but
-  // this doesn't necessarily correspond to any sort of real lru policy just as
-  // an exmaple.
-  std::map<uint64_t, CacheEntry> entry_cache_;
-  void entry_cache_gc();
+  // tail readers read and parse positions in the window claimed by IOEntry
+  // and hand them back through tail_ready_, where IOEntry publishes them to
+  // the entry cache in log order.
+  void TailReaderEntry();
+  boost::optional<CacheEntry> ReadTailEntry(uint64_t pos);
+
+  // replace a serialized log entry with a compressed log entry when
+  // compression is enabled and the entry is a candidate.
+  void CompressEntry(cruzdb_proto::LogEntry::EntryType type,
+      std::string& blob) const;
+
+  // parse a log entry read from the log, transparently decompressing it.
+  void ParseEntry(const std::string& data,
+      cruzdb_proto::LogEntry& entry) const;
+
+  // take ownership of the after image in a parsed log entry
+  static std::shared_ptr<AfterImage> TakeAfterImage(
+      cruzdb_proto::LogEntry& entry);
+
+  // the local after image file cache is optional. lookups return nullptr
+  // when it is disabled or the position isn't cached. since most positions
+  // looked up aren't after images, a miss is counted when an after image is
+  // read from the log and inserted.
+  std::shared_ptr<AfterImage> FileCacheLookup(uint64_t pos);
+  void FileCacheInsert(uint64_t pos, const AfterImage& after_image);
+  std::unique_ptr<AfterImageFileCache> file_cache_;
+
+  // a follower doesn't match intentions with after images
+  const bool follower_;
+
+  const CompressionType compression_;
+  const size_t compression_min_intention_size_;
+
+  // a ring of cache slots indexed by log position with a byte budget.
+  // positions are dense and mostly cached in increasing order, so a slot is
+  // simply replaced by a newer position that maps to it. slots are published
+  // with atomic shared pointer operations, so lookups don't take a lock, and
+  // an entry stays alive for as long as a reader holds a reference to it.
+  // inserts are serialized, and evict the oldest inserted entries when the
+  // cache is over its budget.
+  class EntryCache {
+   public:
+    EntryCache(size_t slots, size_t max_bytes);
+
+    boost::optional<CacheEntry> Lookup(uint64_t pos) const;
+
+    // returns the cached entry, which is an existing entry if the position
+    // was already cached. an entry for a position older than the one in its
+    // slot isn't cached.
+    CacheEntry Insert(uint64_t pos, const CacheEntry& entry, size_t bytes);
+
+    void Erase(uint64_t pos);
+    void Clear();
+
+   private:
+    struct Slot {
+      uint64_t pos;
+      size_t bytes;
+      CacheEntry entry;
+    };
+
+    std::shared_ptr<const Slot>& slot(uint64_t pos) {
+      return slots_[pos % slots_.size()];
+    }
+
+    // replace the contents of a slot. requires lock_.
+    void set_slot(std::shared_ptr<const Slot>& slot,
+        std::shared_ptr<const Slot> next);
+
+    std::vector<std::shared_ptr<const Slot>> slots_;
+    const size_t max_bytes_;
+
+    std::mutex lock_;
+    size_t bytes_;
+    std::deque<uint64_t> fifo_;
+  };
+
+  // intentions and holes are kept in their own cache, so that the intentions
+  // needed to check for conflicts aren't pushed out by large after images.
+  // after images and checkpoints are only needed until they've been absorbed
+  // into the node cache or the restored state, and are erased then.
+  //
+  // both caches evict in insertion order. intentions in a transaction's
+  // conflict zone aren't protected from eviction, so a budget smaller than
+  // the conflict window sends conflict checks to the log, where they are
+  // read in parallel (see ReadIntentions).
+  EntryCache intention_cache_;
+  EntryCache after_image_cache_;
+
+  boost::optional<CacheEntry> CacheLookup(uint64_t pos) const;
+  CacheEntry CacheInsert(uint64_t pos, const CacheEntry& entry);
 
   zlog::Log *log_;
   uint64_t pos_;
@@ -197,7 +309,20 @@ class EntryService {
   std::list<std::condition_variable*> tail_waiters_;
 
   std::thread io_thread_;
-  const size_t cache_size_;
+
+  // next position a tail reader will claim, and the end of the window that
+  // may be claimed. an empty entry in tail_ready_ marks a position that was
+  // already in the entry cache.
+  uint64_t tail_read_pos_;
+  uint64_t tail_read_limit_;
+  std::map<uint64_t, boost::optional<CacheEntry>> tail_ready_;
+  std::condition_variable tail_read_cond_;
+  std::condition_variable tail_ready_cond_;
+  std::vector<std::thread> tail_readers_;
+  const size_t tail_read_threads_;
+  const size_t tail_read_window_;
+
+  const size_t intention_read_parallelism_;
 };
 
 }
@@ -1,4 +1,9 @@
 #pragma once
+#include <iterator>
+#include <map>
+#include <string>
+#include <boost/optional.hpp>
+#include <zlog/slice.h>
 #include "db/cruzdb.pb.h"
 
 namespace cruzdb {
@@ -19,6 +24,13 @@ class Intention {
     pos_(pos)
   {
     assert(intention_.IsInitialized());
+    for (const auto& range : intention_.read_ranges()) {
+      boost::optional<std::string> end;
+      if (range.has_end()) {
+        end = range.end();
+      }
+      read_ranges_.emplace(range.begin(), end);
+    }
   }
 
   void Get(const zlog::Slice& key) {
@@ -43,6 +55,14 @@ class Intention {
     op->set_key(key.ToString());
   }
 
+  void Merge(const zlog::Slice& key, const zlog::Slice& operand) {
+    assert(!pos_);
+    auto op = intention_.add_ops();
+    op->set_op(cruzdb_proto::TransactionOp::MERGE);
+    op->set_key(key.ToString());
+    op->set_val(operand.ToString());
+  }
+
   void Copy(const zlog::Slice& key) {
     assert(!pos_);
     auto op = intention_.add_ops();
@@ -50,6 +70,65 @@ class Intention {
     op->set_key(key.ToString());
   }
 
+  // record that the user keys in [begin, end] were scanned. a range without
+  // an end extends past the last key. overlapping ranges are merged so that
+  // the read set stays a small sorted set of disjoint intervals.
+  void ReadRange(const std::string& begin,
+      const boost::optional<std::string>& end) {
+    assert(!pos_);
+    assert(!end || begin <= *end);
+
+    // the first range that may overlap is the one starting at or before begin
+    auto it = read_ranges_.upper_bound(begin);
+    if (it != read_ranges_.begin()) {
+      auto prev = std::prev(it);
+      if (!prev->second || *prev->second >= begin) {
+        it = prev;
+      }
+    }
+
+    auto new_begin = begin;
+    auto new_end = end;
+    while (it != read_ranges_.end() && (!new_end || it->first <= *new_end)) {
+      if (it->first < new_begin) {
+        new_begin = it->first;
+      }
+      if (new_end && (!it->second || *it->second > *new_end)) {
+        new_end = it->second;
+      }
+      it = read_ranges_.erase(it);
+    }
+
+    read_ranges_.emplace(new_begin, new_end);
+  }
+
+  bool HasMerges() const {
+    for (const auto& op : intention_.ops()) {
+      if (op.op() == cruzdb_proto::TransactionOp::MERGE) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool HasReadRanges() const {
+    return !read_ranges_.empty();
+  }
+
+  // true if the user key falls in a range scanned by the intention
+  bool ReadRangesContain(const std::string& key) const {
+    auto it = read_ranges_.upper_bound(key);
+    if (it == read_ranges_.begin()) {
+      return false;
+    }
+    --it;
+    return !it->second || key <= *it->second;
+  }
+
+  size_t NumReadRanges() const {
+    return read_ranges_.size();
+  }
+
   bool Flush() const {
     return intention_.flush();
   }
@@ -92,6 +171,15 @@ class Intention {
     else
       intention_.set_flush(false);
 
+    intention_.clear_read_ranges();
+    for (const auto& range : read_ranges_) {
+      auto r = intention_.add_read_ranges();
+      r->set_begin(range.first);
+      if (range.second) {
+        r->set_end(*range.second);
+      }
+    }
+
     cruzdb_proto::LogEntry entry;
     entry.set_type(cruzdb_proto::LogEntry::INTENTION);
     entry.set_allocated_intention(&intention_);
@@ -105,15 +193,17 @@ class Intention {
   }
 
   auto begin() const {
-    assert(pos_);
     return intention_.ops().begin();
   }
 
   auto end() const {
-    assert(pos_);
     return intention_.ops().end();
   }
 
+  size_t ByteSize() const {
+    return intention_.ByteSizeLong();
+  }
+
   uint64_t Position() const {
     assert(pos_);
     return *pos_;
@@ -124,28 +214,12 @@ class Intention {
     pos_ = pos;
   }
 
-  std::set<std::string> OpKeys() const {
-    std::set<std::string> keys;
-    for (auto& op : intention_.ops()) {
-      keys.insert(op.key());
-    }
-    return keys;
-  }
-
-  std::set<std::string> UpdateOpKeys() const {
-    std::set<std::string> keys;
-    for (auto& op : intention_.ops()) {
-      if (op.op() == cruzdb_proto::TransactionOp::PUT ||
-          op.op() == cruzdb_proto::TransactionOp::DELETE) {
-        keys.insert(op.key());
-      }
-    }
-    return keys;
-  }
-
  private:
   cruzdb_proto::Intention intention_;
   boost::optional<uint64_t> pos_;
+
+  // scanned ranges keyed by their first key
+  std::map<std::string, boost::optional<std::string>> read_ranges_;
 };
 
 }
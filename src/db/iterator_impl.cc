@@ -203,4 +203,10 @@ zlog::Slice RawIteratorImpl::value() const
       stack_.top()->val().size());
 }
 
+SnapshotIteratorImpl::~SnapshotIteratorImpl()
+{
+  // the iterator's node stack is cleared after the snapshot is released
+  snapshot_->db->ReleaseSnapshot(snapshot_);
+}
+
 }
@@ -152,4 +152,18 @@ class FilteredPrefixIteratorImpl : public PrefixRawIteratorImpl {
   }
 };
 
+// an iterator that releases its snapshot when it is deleted
+class SnapshotIteratorImpl : public FilteredPrefixIteratorImpl {
+ public:
+  SnapshotIteratorImpl(const std::string& prefix, Snapshot *snapshot) :
+    FilteredPrefixIteratorImpl(prefix, snapshot),
+    snapshot_(snapshot)
+  {}
+
+  ~SnapshotIteratorImpl();
+
+ private:
+  Snapshot *snapshot_;
+};
+
 }
@@ -11,6 +11,7 @@
 #ifndef BOOST_COMPUTE_DETAIL_LRU_CACHE_HPP
 #define BOOST_COMPUTE_DETAIL_LRU_CACHE_HPP
 
+#include <limits>
 #include <map>
 #include <list>
 #include <utility>
@@ -109,6 +110,18 @@ public:
         }
     }
 
+    // visit up to limit items from most to least recently used
+    template<typename Func>
+    void for_each(Func func,
+        size_t limit = std::numeric_limits<size_t>::max()) const
+    {
+        for(const auto &key : m_list){
+            if (limit-- == 0)
+                break;
+            func(key, m_map.find(key)->second.first);
+        }
+    }
+
     void clear()
     {
         m_map.clear();
@@ -322,6 +322,11 @@ class Node {
     return zlog::Slice(val_.data(), val_.size());
   }
 
+  inline void set_val(const zlog::Slice& val) {
+    assert(!read_only());
+    val_.assign(val.data(), val.size());
+  }
+
   inline void steal_payload(SharedNodeRef& other) {
     assert(!read_only());
     assert(!other->read_only());
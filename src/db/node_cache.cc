@@ -67,14 +67,40 @@ void NodeCache::do_vaccum_()
           auto key = nodes_lru_.back();
           auto nit = nodes_.find(key);
           assert(nit != nodes_.end());
-          used_bytes_ -= nit->second.node->ByteSize();
-          left -= nit->second.node->ByteSize();
+          const auto bytes = nit->second.node->ByteSize();
+          used_bytes_ -= bytes;
+          left -= bytes;
+          // a node that is still referenced, for instance by an open
+          // iterator or a transaction, stays in memory after it is evicted.
+          if (nit->second.node.use_count() > 1) {
+            RecordTick(stats_, NODE_CACHE_FREE_PINNED);
+            RecordTick(stats_, NODE_CACHE_FREE_PINNED_BYTES, bytes);
+            std::lock_guard<std::mutex> l(pinned_lock_);
+            pinned_.emplace_back(nit->second.node, bytes);
+            pinned_bytes_ += bytes;
+          }
           nodes_.erase(nit);
           nodes_lru_.pop_back();
           RecordTick(stats_, NODE_CACHE_FREE);
         }
       }
     }
+
+    std::lock_guard<std::mutex> pl(pinned_lock_);
+    prune_pinned();
+  }
+}
+
+// caller holds pinned_lock_
+void NodeCache::prune_pinned()
+{
+  for (auto it = pinned_.begin(); it != pinned_.end();) {
+    if (it->first.expired()) {
+      pinned_bytes_ -= it->second;
+      it = pinned_.erase(it);
+    } else {
+      it++;
+    }
   }
 }
 
@@ -100,7 +126,7 @@ uint64_t NodeCache::findAfterImagePosition(
         }
         // TODO: asynchronsly cache the nodes in any non-target afterimages that
         // are read?
-        if (ai->second->intention() == intention) {
+        if (ai->second->Intention() == intention) {
           return ai->first;
           break;
         }
@@ -167,8 +193,9 @@ SharedNodeRef NodeCache::fetch(std::vector<NodeAddress>& trace,
   // it's technically possible that after node is cached its removed, but lru
   // should always prevent that. in any case, we handle that expliclty.
   CacheAfterImage(*ai, afterimage);
+  db_->entry_service_->ReleaseAfterImage(afterimage);
 
-  RecordTick(stats_, NODE_CACHE_NODES_READ, ai->tree_size());
+  RecordTick(stats_, NODE_CACHE_NODES_READ, ai->NumNodes());
 
   // its probably there now
   lk.lock();
@@ -237,31 +264,32 @@ SharedNodeRef NodeCache::fetch(std::vector<NodeAddress>& trace,
 //  ptr.set_ref(e.node);
 //}
 
-NodePtr NodeCache::CacheAfterImage(const cruzdb_proto::AfterImage& i,
-    uint64_t pos)
+NodePtr NodeCache::CacheAfterImage(const AfterImage& i, uint64_t pos)
 {
-  if (i.tree_size() == 0) {
+  if (i.NumNodes() == 0) {
     NodePtr ret(Node::Nil(), nullptr);
     return ret;
   }
 
   int idx;
+  // delta decoded key of the previous node
+  std::string key;
   SharedNodeRef nn = nullptr;
-  for (idx = 0; idx < i.tree_size(); idx++) {
+  for (idx = 0; idx < i.NumNodes(); idx++) {
 
     // no locking on deserialize_node is OK
-    nn = deserialize_node(i, pos, idx);
+    nn = deserialize_node(i, pos, idx, key);
 
-    auto key = std::make_pair(pos, idx);
+    auto cache_key = std::make_pair(pos, idx);
 
-    auto slot = pair_hash()(key) % num_slots_;
+    auto slot = pair_hash()(cache_key) % num_slots_;
     auto& shard = shards_[slot];
     auto& nodes_ = shard->nodes;
     auto& nodes_lru_ = shard->lru;
 
     std::unique_lock<std::mutex> lk(shard->lock);
 
-    auto it = nodes_.find(key);
+    auto it = nodes_.find(cache_key);
     if (it != nodes_.end()) {
       // if this was the last node, then make sure when we fall through to the
       // end of the routine that nn points to this node instead of the one
@@ -270,10 +298,10 @@ NodePtr NodeCache::CacheAfterImage(const cruzdb_proto::AfterImage& i,
       continue;
     }
 
-    nodes_lru_.emplace_front(key);
+    nodes_lru_.emplace_front(cache_key);
     auto iter = nodes_lru_.begin();
     auto res = nodes_.insert(
-        std::make_pair(key, entry{nn, iter}));
+        std::make_pair(cache_key, entry{nn, iter}));
     assert(res.second);
 
     used_bytes_ += nn->ByteSize();
@@ -285,47 +313,68 @@ NodePtr NodeCache::CacheAfterImage(const cruzdb_proto::AfterImage& i,
   return ret;
 }
 
-SharedNodeRef NodeCache::deserialize_node(const cruzdb_proto::AfterImage& i,
+SharedNodeRef NodeCache::deserialize_node(const AfterImage& i,
     uint64_t pos, int index) const
 {
-  const cruzdb_proto::Node& n = i.tree(index);
-
-  auto nn = std::make_shared<Node>(n.key(), n.val(), n.red(),
-      nullptr, nullptr, i.intention(), false, db_);
-
-  if (!n.left().nil()) {
-    uint16_t offset = n.left().off();
-    if (n.left().self()) {
-      nn->left.SetAfterImageAddress(pos, offset);
-    } else if (n.left().has_afterimage()) {
-      assert(!n.left().has_intention());
-      nn->left.SetAfterImageAddress(n.left().afterimage(), offset);
-    } else {
-      assert(n.left().has_intention());
-      nn->left.SetIntentionAddress(n.left().intention(), offset);
-    }
-  } else {
-    nn->left.set_ref(Node::Nil());
+  int first = index;
+  while (first > 0 && i.KeyShared(first) > 0) {
+    first--;
   }
 
-  if (!n.right().nil()) {
-    uint16_t offset = n.right().off();
-    if (n.right().self()) {
-      nn->right.SetAfterImageAddress(pos, offset);
-    } else if (n.right().has_afterimage()) {
-      assert(!n.right().has_intention());
-      nn->right.SetAfterImageAddress(n.right().afterimage(), offset);
-    } else {
-      assert(n.right().has_intention());
-      nn->right.SetIntentionAddress(n.right().intention(), offset);
-    }
-  } else {
-    nn->right.set_ref(Node::Nil());
+  std::string key;
+  for (int idx = first; idx < index; idx++) {
+    const auto suffix = i.KeySuffix(idx);
+    key.resize(i.KeyShared(idx));
+    key.append(suffix.data(), suffix.size());
   }
 
+  return deserialize_node(i, pos, index, key);
+}
+
+SharedNodeRef NodeCache::deserialize_node(const AfterImage& i,
+    uint64_t pos, int index, std::string& key) const
+{
+  const auto shared = i.KeyShared(index);
+  const auto suffix = i.KeySuffix(index);
+  assert(shared <= key.size());
+  key.resize(shared);
+  key.append(suffix.data(), suffix.size());
+
+  auto nn = std::make_shared<Node>(key, i.Val(index), i.Red(index),
+      nullptr, nullptr, i.Intention(), false, db_);
+
+  set_node_ptr(nn->left, i.Left(index), pos);
+  set_node_ptr(nn->right, i.Right(index), pos);
+
   return nn;
 }
 
+void NodeCache::set_node_ptr(NodePtr& dst, const AfterImage::Pointer& src,
+    uint64_t pos)
+{
+  switch (src.type) {
+    case AfterImage::Pointer::NIL:
+      dst.set_ref(Node::Nil());
+      break;
+
+    case AfterImage::Pointer::SELF:
+      dst.SetAfterImageAddress(pos, src.offset);
+      break;
+
+    case AfterImage::Pointer::AFTERIMAGE:
+      dst.SetAfterImageAddress(src.position, src.offset);
+      break;
+
+    case AfterImage::Pointer::INTENTION:
+      dst.SetIntentionAddress(src.position, src.offset);
+      break;
+
+    default:
+      assert(0);
+      exit(1);
+  }
+}
+
 NodePtr NodeCache::ApplyAfterImageDelta(
     const std::vector<SharedNodeRef>& delta,
     uint64_t after_image_pos)
@@ -348,6 +397,13 @@ NodePtr NodeCache::ApplyAfterImageDelta(
 
     std::unique_lock<std::mutex> lk(shard->lock);
 
+    // a snapshot of an older committed state may have already read the node
+    // from the after image in the log.
+    if (nodes_.find(key) != nodes_.end()) {
+      offset++;
+      continue;
+    }
+
     nodes_lru_.emplace_front(key);
     auto iter = nodes_lru_.begin();
     auto res = nodes_.insert(
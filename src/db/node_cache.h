@@ -9,7 +9,7 @@
 #include <zlog/log.h>
 #include "cruzdb/options.h"
 #include "node.h"
-#include "db/cruzdb.pb.h"
+#include "db/after_image.h"
 #include "db/lru_cache.hpp"
 
 namespace cruzdb {
@@ -45,7 +45,8 @@ class NodeCache {
     num_slots_(8),
     cache_size_(options.node_cache_size),
     stats_(options.statistics.get()),
-    imap_(options.imap_cache_size)
+    imap_(options.imap_cache_size),
+    pinned_bytes_(0)
   {
     for (size_t i = 0; i < num_slots_; i++) {
       shards_.push_back(std::unique_ptr<shard>(new shard));
@@ -53,8 +54,7 @@ class NodeCache {
     vaccum_ = std::thread(&NodeCache::do_vaccum_, this);
   }
 
-  NodePtr CacheAfterImage(const cruzdb_proto::AfterImage& i,
-      uint64_t pos);
+  NodePtr CacheAfterImage(const AfterImage& i, uint64_t pos);
   NodePtr ApplyAfterImageDelta(const std::vector<SharedNodeRef>& delta,
       uint64_t after_image_pos);
 
@@ -75,6 +75,26 @@ class NodeCache {
     imap_.insert(intention_pos, after_image_pos);
   }
 
+  // up to limit of the cached intention to after image mappings, most
+  // recently used first
+  std::vector<std::pair<uint64_t, uint64_t>> IntentionMappings(
+      size_t limit) {
+    std::vector<std::pair<uint64_t, uint64_t>> mappings;
+    std::lock_guard<std::mutex> l(lock_);
+    mappings.reserve(std::min(limit, imap_.size()));
+    imap_.for_each([&](uint64_t intention_pos, uint64_t after_image_pos) {
+      mappings.emplace_back(intention_pos, after_image_pos);
+    }, limit);
+    return mappings;
+  }
+
+  // see SnapshotStats::pinned_bytes
+  size_t PinnedBytes() {
+    std::lock_guard<std::mutex> l(pinned_lock_);
+    prune_pinned();
+    return pinned_bytes_;
+  }
+
   void Stop() {
     lock_.lock();
     stop_ = true;
@@ -148,8 +168,23 @@ class NodeCache {
 
   lru_cache<uint64_t, uint64_t> imap_;
 
-  SharedNodeRef deserialize_node(const cruzdb_proto::AfterImage& i,
+  // nodes that were evicted while still referenced, and their total size.
+  // entries are dropped once the node is freed.
+  std::mutex pinned_lock_;
+  std::list<std::pair<std::weak_ptr<Node>, size_t>> pinned_;
+  size_t pinned_bytes_;
+  void prune_pinned();
+
+  // keys in an after image are delta encoded (see AfterImage). when
+  // deserializing nodes in order, key holds the key of the node at index - 1
+  // and is updated to hold the key of the node at index. the variant without a
+  // key reconstructs it starting from the closest preceding full key.
+  SharedNodeRef deserialize_node(const AfterImage& i,
+      uint64_t pos, int index, std::string& key) const;
+  SharedNodeRef deserialize_node(const AfterImage& i,
       uint64_t pos, int index) const;
+  static void set_node_ptr(NodePtr& dst, const AfterImage::Pointer& src,
+      uint64_t pos);
 
   std::thread vaccum_;
   std::condition_variable cond_;
@@ -92,13 +92,17 @@ boost::optional<int> PersistentTree::infect_self_pointers(uint64_t intention,
   }
   rid_ = (int64_t)intention;
 
+  // an intention that didn't change the tree still copies the root so that
+  // its after image identifies the resulting tree.
   if (root_ == nullptr) {
     root_ = Node::Copy(src_root_.ref_notrace(), db_, rid_);
+  }
+
+  if (root_ == Node::Nil()) {
     return boost::none;
   }
 
-  assert(root_ == Node::Nil() ||
-      root_->rid() == rid_);
+  assert(root_->rid() == rid_);
 
   int field_index = 0;
   infect_after_image(root_, intention, field_index);
@@ -107,56 +111,72 @@ boost::optional<int> PersistentTree::infect_self_pointers(uint64_t intention,
   return field_index - 1;
 }
 
-void PersistentTree::serialize_node_ptr(cruzdb_proto::NodePtr *dst,
-    NodePtr& src, int maybe_offset)
+AfterImage::Pointer PersistentTree::serialize_node_ptr(NodePtr& src,
+    int maybe_offset)
 {
+  // the AfterImage name is shadowed by PersistentTree::AfterImage
+  using Pointer = cruzdb::AfterImage::Pointer;
+
   if (src.ref(trace_) == Node::Nil()) {
-    dst->set_nil(true);
-    dst->set_self(false);
+    return Pointer{Pointer::NIL, 0, 0};
   } else if (src.ref(trace_)->rid() == rid_) {
-    dst->set_nil(false);
-    dst->set_self(true);
-    dst->set_off(maybe_offset);
     // assert the offset was set correctly during infection.
     assert(src.Address());
     assert(src.Address()->Offset() == maybe_offset);
+    return Pointer{Pointer::SELF, 0,
+      static_cast<uint16_t>(maybe_offset)};
   } else {
     auto address = src.Address();
     assert(address);
 
     assert(src.ref(trace_) != nullptr);
-    dst->set_nil(false);
-    dst->set_self(false);
 
     if (address->IsAfterImage()) {
-      dst->set_afterimage(address->Position());
+      return Pointer{Pointer::AFTERIMAGE,
+        address->Position(), address->Offset()};
     } else {
       const auto i_pos = address->Position();
       const auto ai_pos = db_->IntentionToAfterImage(i_pos);
       if (ai_pos) {
-        dst->set_afterimage(*ai_pos);
+        return Pointer{Pointer::AFTERIMAGE,
+          *ai_pos, address->Offset()};
       } else {
-        dst->set_intention(i_pos);
+        return Pointer{Pointer::INTENTION,
+          i_pos, address->Offset()};
       }
     }
-
-    dst->set_off(address->Offset());
   }
 }
 
-void PersistentTree::serialize_node(cruzdb_proto::Node *dst,
-    SharedNodeRef node, int maybe_left_offset, int maybe_right_offset)
+// a restart node stores its full key, otherwise only the suffix not shared with
+// prev_key is stored. in either case prev_key is updated to hold this node's key
+// for encoding the next node.
+void PersistentTree::serialize_node(AfterImageBuilder& i,
+    SharedNodeRef node, int maybe_left_offset, int maybe_right_offset,
+    std::string& prev_key, bool restart)
 {
-  dst->set_red(node->red());
-  dst->set_key(node->key().ToString());
-  dst->set_val(node->val().ToString());
+  const auto key = node->key();
 
-  serialize_node_ptr(dst->mutable_left(), node->left, maybe_left_offset);
-  serialize_node_ptr(dst->mutable_right(), node->right, maybe_right_offset);
+  size_t shared = 0;
+  if (!restart) {
+    const size_t limit = std::min(prev_key.size(), key.size());
+    while (shared < limit && prev_key[shared] == key[shared]) {
+      shared++;
+    }
+  }
+
+  i.Add(node->red(), shared,
+      zlog::Slice(key.data() + shared, key.size() - shared),
+      node->val(),
+      serialize_node_ptr(node->left, maybe_left_offset),
+      serialize_node_ptr(node->right, maybe_right_offset));
+
+  prev_key.assign(key.data(), key.size());
 }
 
-void PersistentTree::serialize_intention(cruzdb_proto::AfterImage& i,
-    SharedNodeRef node, int& field_index, std::vector<SharedNodeRef>& delta)
+void PersistentTree::serialize_intention(AfterImageBuilder& i,
+    SharedNodeRef node, int& field_index, std::vector<SharedNodeRef>& delta,
+    std::string& prev_key)
 {
   assert(node != nullptr);
 
@@ -168,20 +188,21 @@ void PersistentTree::serialize_intention(cruzdb_proto::AfterImage& i,
   // serialized. if the node is non-nil and is a new node in the afterimage,
   // then maybe_left_offset is valid (its validity is checked in
   // serialize_node_ptr).
-  serialize_intention(i, node->left.ref(trace_), field_index, delta);
+  serialize_intention(i, node->left.ref(trace_), field_index, delta, prev_key);
   auto maybe_left_offset = field_index - 1;
 
-  serialize_intention(i, node->right.ref(trace_), field_index, delta);
+  serialize_intention(i, node->right.ref(trace_), field_index, delta, prev_key);
   auto maybe_right_offset = field_index - 1;
 
   // new serialized node in the intention
-  cruzdb_proto::Node *dst = i.add_tree();
-  serialize_node(dst, node, maybe_left_offset, maybe_right_offset);
+  const bool restart = (field_index % AFTER_IMAGE_KEY_RESTART_INTERVAL) == 0;
+  serialize_node(i, node, maybe_left_offset, maybe_right_offset,
+      prev_key, restart);
   delta.push_back(node);
   field_index++;
 }
 
-void PersistentTree::SerializeAfterImage(cruzdb_proto::AfterImage& i,
+void PersistentTree::SerializeAfterImage(AfterImageBuilder& i,
     uint64_t intention,
     std::vector<SharedNodeRef>& delta)
 {
@@ -192,11 +213,15 @@ void PersistentTree::SerializeAfterImage(cruzdb_proto::AfterImage& i,
   } else
     assert(root_->rid() == rid_);
 
-  serialize_intention(i, root_, field_index, delta);
+  std::string prev_key;
+  serialize_intention(i, root_, field_index, delta, prev_key);
 
   // only valid when the transaction is being used to produce after images when
   // processing intentions from the log.
-  i.set_intention(intention);
+  i.SetIntention(intention);
+  if (prev_intention_) {
+    i.SetPrevIntention(*prev_intention_);
+  }
 }
 
 void PersistentTree::SetDeltaPosition(std::vector<SharedNodeRef>& delta,
@@ -212,6 +237,120 @@ void PersistentTree::SetDeltaPosition(std::vector<SharedNodeRef>& delta,
   }
 }
 
+// walk the source tree along the nodes read while building this tree, and the
+// same paths in the new root. the nodes must agree on key and color, and empty
+// subtrees of read nodes must stay empty since an update may have tested them.
+// ptrs collects the pointer in the new root at the position of each child of
+// a read node, and nodes the new version of each read node.
+bool PersistentTree::meld_check(const SharedNodeRef& src, NodePtr& dst,
+    const std::unordered_set<std::string>& read_keys,
+    std::map<std::string, NodePtr>& ptrs,
+    std::map<std::string, MeldNode>& nodes)
+{
+  auto node = dst.ref(trace_);
+  if (node == Node::Nil() || node->red() != src->red() ||
+      node->key().compare(src->key()) != 0) {
+    return false;
+  }
+
+  nodes.emplace(src->key().ToString(),
+      MeldNode{src->val().ToString(), node});
+
+  for (auto child : {left, right}) {
+    auto src_child = child(src).ref(trace_);
+    auto& dst_child = child(node);
+    if (src_child == Node::Nil()) {
+      if (dst_child.ref(trace_) != Node::Nil()) {
+        return false;
+      }
+      continue;
+    }
+
+    auto key = src_child->key().ToString();
+    ptrs.emplace(key, dst_child);
+    if (read_keys.count(key) &&
+        !meld_check(src_child, dst_child, read_keys, ptrs, nodes)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// point the new nodes at the subtrees of the new root rather than those of
+// the source tree. a new node copied from the source tree also takes the
+// node's newer value, unless the transaction wrote the key, since a key
+// written concurrently would have been a conflict.
+bool PersistentTree::meld_apply(const SharedNodeRef& node,
+    std::map<std::string, NodePtr>& ptrs,
+    std::map<std::string, MeldNode>& nodes)
+{
+  assert(node->rid() == rid_);
+
+  auto it = nodes.find(node->key().ToString());
+  if (it != nodes.end() && node->val().compare(it->second.src_val) == 0) {
+    node->set_val(it->second.node->val());
+  }
+
+  for (auto child : {left, right}) {
+    auto& ptr = child(node);
+    auto child_node = ptr.ref(trace_);
+    if (child_node == Node::Nil()) {
+      continue;
+    }
+
+    if (child_node->rid() == rid_) {
+      if (!meld_apply(child_node, ptrs, nodes)) {
+        return false;
+      }
+      continue;
+    }
+
+    auto it = ptrs.find(child_node->key().ToString());
+    if (it == ptrs.end()) {
+      return false;
+    }
+    ptr = it->second;
+  }
+
+  return true;
+}
+
+bool PersistentTree::Meld(NodePtr root)
+{
+  assert(reads_);
+  assert(root_ != nullptr);
+
+  TraceApplier ta(this);
+
+  std::unordered_set<std::string> read_keys;
+  for (const auto& node : *reads_) {
+    read_keys.emplace(node->key().data(), node->key().size());
+  }
+  reads_.reset();
+
+  std::map<std::string, NodePtr> ptrs;
+  std::map<std::string, MeldNode> nodes;
+
+  auto src = src_root_.ref(trace_);
+  if (src == Node::Nil()) {
+    if (root.ref(trace_) != Node::Nil()) {
+      return false;
+    }
+  } else if (!meld_check(src, root, read_keys, ptrs, nodes)) {
+    return false;
+  }
+
+  if (root_ != Node::Nil()) {
+    if (root_->rid() != rid_ || !meld_apply(root_, ptrs, nodes)) {
+      return false;
+    }
+  }
+
+  src_root_ = root;
+
+  return true;
+}
 
 SharedNodeRef PersistentTree::insert_recursive(std::deque<SharedNodeRef>& path,
     const zlog::Slice& key, const zlog::Slice& value, const SharedNodeRef& node)
@@ -239,7 +378,7 @@ SharedNodeRef PersistentTree::insert_recursive(std::deque<SharedNodeRef>& path,
     return nullptr;
 
   auto child = insert_recursive(path, key, value,
-      (less ? node->left.ref(trace_) : node->right.ref(trace_)));
+      (less ? deref(node->left) : deref(node->right)));
 
   if (child == nullptr)
     return child;
@@ -275,11 +414,11 @@ SharedNodeRef PersistentTree::rotate(SharedNodeRef parent,
   // copy over ref and csn/off because we might be moving a pointer that
   // points outside of the current intentino.
   NodePtr grand_child = child_b(child); // copy constructor makes grand_child read-only
-  child_b(child) = child_a(grand_child.ref(trace_));
+  child_b(child) = child_a(deref(grand_child));
 
   if (root == child) {
-    root = grand_child.ref(trace_);
-  } else if (child_a(parent).ref(trace_) == child)
+    root = deref(grand_child);
+  } else if (deref(child_a(parent)) == child)
     child_a(parent) = grand_child;
   else
     child_b(parent) = grand_child;
@@ -288,9 +427,9 @@ SharedNodeRef PersistentTree::rotate(SharedNodeRef parent,
   // in the current intention so its csn/off will be updated during intention
   // serialization step.
   assert(child->rid() == rid_);
-  child_a(grand_child.ref(trace_)).set_ref(child);
+  child_a(deref(grand_child)).set_ref(child);
 
-  return grand_child.ref(trace_);
+  return deref(grand_child);
 }
 
 template<typename ChildA, typename ChildB>
@@ -300,19 +439,19 @@ void PersistentTree::insert_balance(SharedNodeRef& parent, SharedNodeRef& nn,
 {
   assert(path.front() != Node::Nil());
   NodePtr& uncle = child_b(path.front());
-  if (uncle.ref(trace_)->red()) {
-    if (uncle.ref(trace_)->rid() != rid_) {
-      auto n = Node::Copy(uncle.ref(trace_), db_, rid_);
+  if (deref(uncle)->red()) {
+    if (deref(uncle)->rid() != rid_) {
+      auto n = Node::Copy(deref(uncle), db_, rid_);
       fresh_nodes_.push_back(n);
       uncle.set_ref(n);
     }
     parent->set_red(false);
-    uncle.ref(trace_)->set_red(false);
+    deref(uncle)->set_red(false);
     path.front()->set_red(true);
     nn = pop_front(path);
     parent = pop_front(path);
   } else {
-    if (nn == child_b(parent).ref(trace_)) {
+    if (nn == deref(child_b(parent))) {
       std::swap(nn, parent);
       rotate(path.front(), nn, child_a, child_b, root);
     }
@@ -349,7 +488,7 @@ SharedNodeRef PersistentTree::delete_recursive(std::deque<SharedNodeRef>& path,
   }
 
   auto child = delete_recursive(path, key,
-      (less ? node->left.ref(trace_) : node->right.ref(trace_)));
+      (less ? deref(node->left) : deref(node->right)));
 
   if (child == nullptr) {
     return child;
@@ -384,7 +523,7 @@ void PersistentTree::transplant(SharedNodeRef parent, SharedNodeRef removed,
 {
   if (parent == Node::Nil()) {
     root = transplanted;
-  } else if (parent->left.ref(trace_) == removed) {
+  } else if (deref(parent->left) == removed) {
     parent->left.set_ref(transplanted);
   } else {
     parent->right.set_ref(transplanted);
@@ -395,15 +534,15 @@ SharedNodeRef PersistentTree::build_min_path(SharedNodeRef node, std::deque<Shar
 {
   assert(node != nullptr);
   assert(node->left.ref(trace_) != nullptr);
-  while (node->left.ref(trace_) != Node::Nil()) {
+  while (deref(node->left) != Node::Nil()) {
     assert(node->left.ref(trace_) != nullptr);
-    if (node->left.ref(trace_)->rid() != rid_) {
-      auto n = Node::Copy(node->left.ref(trace_), db_, rid_);
+    if (deref(node->left)->rid() != rid_) {
+      auto n = Node::Copy(deref(node->left), db_, rid_);
       fresh_nodes_.push_back(n);
       node->left.set_ref(n);
     }
     path.push_front(node);
-    node = node->left.ref(trace_);
+    node = deref(node->left);
     assert(node != nullptr);
   }
   return node;
@@ -413,7 +552,7 @@ template<typename ChildA, typename ChildB>
 void PersistentTree::mirror_remove_balance(SharedNodeRef& extra_black, SharedNodeRef& parent,
     std::deque<SharedNodeRef>& path, ChildA child_a, ChildB child_b, SharedNodeRef& root)
 {
-  SharedNodeRef brother = child_b(parent).ref(trace_);
+  SharedNodeRef brother = deref(child_b(parent));
 
   if (brother->red()) {
     if (brother->rid() != rid_) {
@@ -422,13 +561,13 @@ void PersistentTree::mirror_remove_balance(SharedNodeRef& extra_black, SharedNod
       child_b(parent).set_ref(n);
     } else
       child_b(parent).set_ref(brother);
-    brother = child_b(parent).ref(trace_);
+    brother = deref(child_b(parent));
 
     brother->swap_color(parent);
     rotate(path.front(), parent, child_a, child_b, root);
     path.push_front(brother);
 
-    brother = child_b(parent).ref(trace_);
+    brother = deref(child_b(parent));
   }
 
   assert(brother != nullptr);
@@ -436,34 +575,34 @@ void PersistentTree::mirror_remove_balance(SharedNodeRef& extra_black, SharedNod
   assert(brother->left.ref(trace_) != nullptr);
   assert(brother->right.ref(trace_) != nullptr);
 
-  if (!brother->left.ref(trace_)->red() && !brother->right.ref(trace_)->red()) {
+  if (!deref(brother->left)->red() && !deref(brother->right)->red()) {
     if (brother->rid() != rid_) {
       auto n = Node::Copy(brother, db_, rid_);
       fresh_nodes_.push_back(n);
       child_b(parent).set_ref(n);
     } else
       child_b(parent).set_ref(brother);
-    brother = child_b(parent).ref(trace_);
+    brother = deref(child_b(parent));
 
     brother->set_red(true);
     extra_black = parent;
     parent = pop_front(path);
   } else {
-    if (!child_b(brother).ref(trace_)->red()) {
+    if (!deref(child_b(brother))->red()) {
       if (brother->rid() != rid_) {
         auto n = Node::Copy(brother, db_, rid_);
         fresh_nodes_.push_back(n);
         child_b(parent).set_ref(n);
       } else
         child_b(parent).set_ref(brother);
-      brother = child_b(parent).ref(trace_);
+      brother = deref(child_b(parent));
 
-      if (child_a(brother).ref(trace_)->rid() != rid_) {
-        auto n = Node::Copy(child_a(brother).ref(trace_), db_, rid_);
+      if (deref(child_a(brother))->rid() != rid_) {
+        auto n = Node::Copy(deref(child_a(brother)), db_, rid_);
         fresh_nodes_.push_back(n);
         child_a(brother).set_ref(n);
       }
-      brother->swap_color(child_a(brother).ref(trace_));
+      brother->swap_color(deref(child_a(brother)));
       brother = rotate(parent, brother, child_b, child_a, root);
     }
 
@@ -473,16 +612,16 @@ void PersistentTree::mirror_remove_balance(SharedNodeRef& extra_black, SharedNod
       child_b(parent).set_ref(n);
     } else
       child_b(parent).set_ref(brother);
-    brother = child_b(parent).ref(trace_);
+    brother = deref(child_b(parent));
 
-    if (child_b(brother).ref(trace_)->rid() != rid_) {
-      auto n = Node::Copy(child_b(brother).ref(trace_), db_, rid_);
+    if (deref(child_b(brother))->rid() != rid_) {
+      auto n = Node::Copy(deref(child_b(brother)), db_, rid_);
       fresh_nodes_.push_back(n);
       child_b(brother).set_ref(n);
     }
     brother->set_red(parent->red());
     parent->set_red(false);
-    child_b(brother).ref(trace_)->set_red(false);
+    deref(child_b(brother))->set_red(false);
     rotate(path.front(), parent, child_a, child_b, root);
 
     extra_black = root;
@@ -503,7 +642,7 @@ void PersistentTree::balance_delete(SharedNodeRef extra_black,
   //assert(parent->left.ref() != nullptr);
 
   while (extra_black != root && !extra_black->red()) {
-    if (parent->left.ref(trace_) == extra_black)
+    if (deref(parent->left) == extra_black)
       mirror_remove_balance(extra_black, parent, path, left, right, root);
     else
       mirror_remove_balance(extra_black, parent, path, right, left, root);
@@ -556,7 +695,7 @@ SharedNodeRef PersistentTree::copy_recursive(const zlog::Slice& key,
   }
 
   auto child = copy_recursive(key,
-      (less ? node->left.ref(trace_) : node->right.ref(trace_)));
+      (less ? deref(node->left) : deref(node->right)));
 
   if (child == nullptr)
     return child;
@@ -581,7 +720,7 @@ void PersistentTree::Copy(const zlog::Slice& prefixed_key)
 {
   TraceApplier ta(this);
 
-  auto base_root = root_ == nullptr ? src_root_.ref(trace_) : root_;
+  auto base_root = root_ == nullptr ? deref(src_root_) : root_;
   auto root = copy_recursive(prefixed_key, base_root);
   if (root) {
     // an existing path is replaced, so no rebalance necessary.
@@ -604,7 +743,7 @@ void PersistentTree::Put(const zlog::Slice& prefixed_key,
   std::deque<SharedNodeRef> path;
 
   //src_root_.Print();
-  auto base_root = root_ == nullptr ? src_root_.ref(trace_) : root_;
+  auto base_root = root_ == nullptr ? deref(src_root_) : root_;
   auto root = insert_recursive(path, prefixed_key, value, base_root);
   if (root == nullptr) {
     /*
@@ -632,7 +771,7 @@ void PersistentTree::Put(const zlog::Slice& prefixed_key,
   while (parent->red()) {
     assert(!path.empty());
     auto grand_parent = path.front();
-    if (grand_parent->left.ref(trace_) == parent)
+    if (deref(grand_parent->left) == parent)
       insert_balance(parent, nn, path, left, right, root);
     else
       insert_balance(parent, nn, path, right, left, root);
@@ -668,7 +807,7 @@ void PersistentTree::Delete(const zlog::Slice& key)
 
   std::deque<SharedNodeRef> path;
 
-  auto base_root = root_ == nullptr ? src_root_.ref(trace_) : root_;
+  auto base_root = root_ == nullptr ? deref(src_root_) : root_;
   auto root = delete_recursive(path, key, base_root);
   if (root == nullptr) {
     return;
@@ -685,29 +824,29 @@ void PersistentTree::Delete(const zlog::Slice& key)
   assert(removed != nullptr);
   assert(removed->key() == key);
 
-  auto transplanted = removed->right.ref(trace_);
+  auto transplanted = deref(removed->right);
   assert(transplanted != nullptr);
 
-  if (removed->left.ref(trace_) == Node::Nil()) {
+  if (deref(removed->left) == Node::Nil()) {
     path.pop_front();
     transplant(path.front(), removed, transplanted, root);
     assert(transplanted != nullptr);
-  } else if (removed->right.ref(trace_) == Node::Nil()) {
+  } else if (deref(removed->right) == Node::Nil()) {
     path.pop_front();
     assert(removed->left.ref(trace_) != nullptr);
-    transplanted = removed->left.ref(trace_);
+    transplanted = deref(removed->left);
     transplant(path.front(), removed, transplanted, root);
     assert(transplanted != nullptr);
   } else {
     assert(transplanted != nullptr);
     auto temp = removed;
-    if (removed->right.ref(trace_)->rid() != rid_) {
-      auto n = Node::Copy(removed->right.ref(trace_), db_, rid_);
+    if (deref(removed->right)->rid() != rid_) {
+      auto n = Node::Copy(deref(removed->right), db_, rid_);
       fresh_nodes_.push_back(n);
       removed->right.set_ref(n);
     }
-    removed = build_min_path(removed->right.ref(trace_), path);
-    transplanted = removed->right.ref(trace_);
+    removed = build_min_path(deref(removed->right), path);
+    transplanted = deref(removed->right);
     assert(transplanted != nullptr);
 
     //temp->key = std::move(removed->key);
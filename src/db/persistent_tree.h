@@ -1,15 +1,23 @@
 #pragma once
 #include "node.h"
+#include "db/after_image.h"
 #include "db/cruzdb.pb.h"
 #include <deque>
+#include <map>
 #include <sstream>
 #include <atomic>
+#include <unordered_set>
 
 namespace cruzdb {
 
 const std::string PREFIX_USER = "U";
 const std::string PREFIX_COMMITTED_INTENTION = "C";
 
+// keys in an after image are delta encoded against the previous node. every Nth
+// node stores its full key which bounds the work needed to reconstruct the key
+// of a single node without decoding the entire after image.
+const int AFTER_IMAGE_KEY_RESTART_INTERVAL = 16;
+
 /**
  * rid: this value uniquely identifies a tree delta (a root plus any nodes
  * creates through tree modifications within a single context). tree deltas are
@@ -96,6 +104,39 @@ class PersistentTree {
     return root_;
   }
 
+  // the root of the tree including any updates made so far
+  NodePtr View() const {
+    if (root_) {
+      return NodePtr(root_, db_);
+    }
+    return src_root_;
+  }
+
+  // record the nodes in the source tree that are read while the tree is
+  // updated, which makes the tree a candidate for Meld.
+  void TrackReads() {
+    assert(!root_);
+    reads_ = std::make_unique<std::vector<SharedNodeRef>>();
+  }
+
+  // a tree that won't be melded doesn't need to keep the nodes it read.
+  void DropReads() {
+    reads_.reset();
+  }
+
+  bool TracksReads() const {
+    return reads_ != nullptr;
+  }
+
+  // rebase the updates in this tree from the source tree onto root, a newer
+  // version of the source tree. this succeeds only when every node that was
+  // read while building the tree is unchanged in root apart from its value
+  // and the subtrees that were not read. in that case replaying the updates
+  // against root makes the same decisions and produces the same tree, which
+  // is what this becomes, without copying or rebalancing any nodes. returns
+  // false, leaving the tree unusable, if the reads were invalidated.
+  bool Meld(NodePtr root);
+
   void SetIntention(uint64_t pos) {
     assert(!intention_);
     intention_ = pos;
@@ -116,11 +157,18 @@ class PersistentTree {
     return *afterimage_;
   }
 
+  // the committed intention this tree was built on. it is recorded in the
+  // after image as a backpointer to the previous commit.
+  void SetPrevIntention(uint64_t pos) {
+    assert(!prev_intention_);
+    prev_intention_ = pos;
+  }
+
   // serialization and fix-up
  public:
   boost::optional<int> infect_self_pointers(uint64_t intention,
       bool expect_intention_rid);
-  void SerializeAfterImage(cruzdb_proto::AfterImage& i,
+  void SerializeAfterImage(AfterImageBuilder& i,
       uint64_t intention,
       std::vector<SharedNodeRef>& delta);
   void SetDeltaPosition(std::vector<SharedNodeRef>& delta, uint64_t pos);
@@ -131,13 +179,14 @@ class PersistentTree {
   void infect_node(SharedNodeRef node, uint64_t intention, int maybe_left_offset, int maybe_right_offset);
   void infect_after_image(SharedNodeRef node, uint64_t intention, int& field_index);
 
-  void serialize_node_ptr(cruzdb_proto::NodePtr *dst, NodePtr& src,
+  cruzdb::AfterImage::Pointer serialize_node_ptr(NodePtr& src,
       int maybe_offset);
-  void serialize_node(cruzdb_proto::Node *dst, SharedNodeRef node,
-      int maybe_left_offset, int maybe_right_offset);
-  void serialize_intention(cruzdb_proto::AfterImage& i,
+  void serialize_node(AfterImageBuilder& i, SharedNodeRef node,
+      int maybe_left_offset, int maybe_right_offset,
+      std::string& prev_key, bool restart);
+  void serialize_intention(AfterImageBuilder& i,
       SharedNodeRef node, int& field_index,
-      std::vector<SharedNodeRef>& delta);
+      std::vector<SharedNodeRef>& delta, std::string& prev_key);
 
 
   // tree management
@@ -153,6 +202,29 @@ class PersistentTree {
   void Delete(const zlog::Slice& key);
   int Get(const zlog::Slice& key, std::string *value);
 
+  // dereference a pointer while updating the tree, recording nodes that
+  // belong to the source tree when reads are tracked.
+  SharedNodeRef deref(NodePtr& ptr) {
+    auto node = ptr.ref(trace_);
+    if (reads_ && node != Node::Nil() && node->rid() != rid_) {
+      reads_->push_back(node);
+    }
+    return node;
+  }
+
+  struct MeldNode {
+    std::string src_val;
+    SharedNodeRef node;
+  };
+
+  bool meld_check(const SharedNodeRef& src, NodePtr& dst,
+      const std::unordered_set<std::string>& read_keys,
+      std::map<std::string, NodePtr>& ptrs,
+      std::map<std::string, MeldNode>& nodes);
+  bool meld_apply(const SharedNodeRef& node,
+      std::map<std::string, NodePtr>& ptrs,
+      std::map<std::string, MeldNode>& nodes);
+
   static inline NodePtr& left(SharedNodeRef n) { return n->left; };
   static inline NodePtr& right(SharedNodeRef n) { return n->right; };
 
@@ -223,6 +295,7 @@ class PersistentTree {
 
   boost::optional<uint64_t> intention_;
   boost::optional<uint64_t> afterimage_;
+  boost::optional<uint64_t> prev_intention_;
 
   // access trace used to update lru cache. the trace is applied and reset
   // after each operation (e.g. get/put/etc) or if the transaction accesses
@@ -242,6 +315,10 @@ class PersistentTree {
   //
   std::vector<SharedNodeRef> fresh_nodes_;
 
+  // source tree nodes read by updates, which may repeat. the keys are only
+  // collected if the tree is melded. see TrackReads.
+  std::unique_ptr<std::vector<SharedNodeRef>> reads_;
+
 };
 
 }
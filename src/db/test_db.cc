@@ -3,12 +3,21 @@
 #include <random>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <spdlog/spdlog.h>
 #include "cruzdb/db.h"
+#include "cruzdb/merge_operator.h"
+#include "cruzdb/statistics.h"
 #include <zlog/log.h>
 #include "port/stack_trace.h"
+#include "util/coding.h"
+#include "util/compression.h"
 
 #define MAX_KEY 1000
 
@@ -405,6 +414,982 @@ TEST(DB, ReOpen) {
   delete log;
 }
 
+// keys sharing long prefixes are delta encoded in after images. a tiny node
+// cache forces nodes to be rebuilt from the log on each access.
+TEST(DB, ReOpenSharedKeyPrefix) {
+  TempDir tdir;
+
+  cruzdb::Options options;
+  options.node_cache_size = 1024;
+  options.entry_cache_size = 1;
+
+  std::map<std::string, std::string> prev_db;
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 20; i++) {
+      auto *txn = db->BeginTransaction();
+      for (int j = 0; j < 10; j++) {
+        std::stringstream ss;
+        ss << "users/profile/" << std::setw(8) << std::setfill('0') << (i * 10 + j);
+        const std::string key = ss.str();
+        txn->Put(key, key + "-val");
+        prev_db[key] = key + "-val";
+      }
+      txn->Commit();
+      delete txn;
+    }
+
+    delete db;
+    delete log;
+  }
+
+  zlog::Log *log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  for (const auto& kv : prev_db) {
+    std::string val;
+    ret = db->Get(kv.first, &val);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(val, kv.second);
+  }
+
+  ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReOpenCompressed) {
+  for (auto type : {cruzdb::kLZ4Compression, cruzdb::kZSTDCompression}) {
+    if (!cruzdb::CompressionTypeSupported(type))
+      continue;
+
+    TempDir tdir;
+
+    cruzdb::Options options;
+    options.compression = type;
+    options.compression_min_intention_size = 0;
+    options.statistics = cruzdb::CreateDBStatistics();
+
+    std::map<std::string, std::string> prev_db;
+    {
+      zlog::Log *log;
+      int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+      ASSERT_EQ(ret, 0);
+
+      cruzdb::DB *db;
+      ret = cruzdb::DB::Open(options, log, true, &db);
+      ASSERT_EQ(0, ret);
+
+      for (int i = 0; i < 50; i++) {
+        auto *txn = db->BeginTransaction();
+        const std::string key = tostr(i);
+        const std::string val(200, 'a' + (i % 26));
+        txn->Put(key, val);
+        prev_db[key] = val;
+        txn->Commit();
+        delete txn;
+      }
+
+      delete db;
+      delete log;
+    }
+
+    ASSERT_GT(options.statistics->getTickerCount(cruzdb::BYTES_UNCOMPRESSED),
+        options.statistics->getTickerCount(cruzdb::BYTES_COMPRESSED));
+
+    // re-open without compression; compressed entries remain readable
+    cruzdb::Options options2;
+    options2.statistics = cruzdb::CreateDBStatistics();
+
+    zlog::Log *log;
+    int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options2, log, false, &db);
+    ASSERT_EQ(ret, 0);
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+    ASSERT_GT(options2.statistics->getTickerCount(cruzdb::BYTES_DECOMPRESSED), 0u);
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, ReOpenMixedAfterImageFormats) {
+  TempDir tdir;
+
+  std::map<std::string, std::string> prev_db;
+
+  // alternate between protobuf and flat after images across re-opens
+  for (int round = 0; round < 4; round++) {
+    cruzdb::Options options;
+    options.flat_after_images = (round % 2) == 1;
+    options.node_cache_size = 1024;
+    options.entry_cache_size = 1;
+
+    zlog::Log *log;
+    int ret;
+    if (round == 0) {
+      ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    } else {
+      ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    }
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, round == 0, &db);
+    ASSERT_EQ(ret, 0);
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    for (int i = 0; i < 50; i++) {
+      auto *txn = db->BeginTransaction();
+      const std::string key = tostr(round * 100 + i);
+      const std::string val = tostr(i);
+      txn->Put(key, val);
+      prev_db[key] = val;
+      txn->Commit();
+      delete txn;
+    }
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, ReOpenAfterImageFileCache) {
+  TempDir tdir;
+
+  cruzdb::Options options;
+  options.after_image_cache_path = std::string(tdir.path) + "/ai_cache";
+  // small enough that the cache file wraps around
+  options.after_image_cache_size = 1 << 16;
+  options.node_cache_size = 1024;
+  options.entry_cache_size = 1;
+
+  std::map<std::string, std::string> prev_db;
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 200; i++) {
+      auto *txn = db->BeginTransaction();
+      const std::string key = tostr(i);
+      const std::string val = tostr(i * 2);
+      txn->Put(key, val);
+      prev_db[key] = val;
+      txn->Commit();
+      delete txn;
+    }
+
+    delete db;
+    delete log;
+  }
+
+  options.statistics = cruzdb::CreateDBStatistics();
+
+  zlog::Log *log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+  ASSERT_GT(options.statistics->getTickerCount(
+        cruzdb::AFTER_IMAGE_FILE_CACHE_HIT), 0u);
+
+  delete db;
+  delete log;
+
+  // logs with the same layout put different after images at the same
+  // positions. a log must not read another log's after images from the cache.
+  TempDir tdir2, tdir3;
+  for (const auto path : {tdir2.path, tdir3.path}) {
+    ret = zlog::Log::Create("lmdb", "log", {{"path", path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(ret, 0);
+
+    auto *txn = db->BeginTransaction();
+    txn->Put("a", path);
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+
+    delete db;
+    delete log;
+  }
+
+  // reopening reads the after images from the log into the cache, so the
+  // first reopen fills the cache that the second reopen would look in.
+  for (const auto path : {tdir3.path, tdir2.path}) {
+    ret = zlog::Log::Open("lmdb", "log", {{"path", path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    ret = cruzdb::DB::Open(options, log, false, &db);
+    ASSERT_EQ(ret, 0);
+
+    std::string val;
+    ASSERT_EQ(db->Get("a", &val), 0);
+    ASSERT_EQ(val, path);
+
+    delete db;
+    delete log;
+  }
+
+  // the cache is disabled while another instance holds the file
+  int fd = open(options.after_image_cache_path.c_str(), O_RDWR);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(flock(fd, LOCK_EX | LOCK_NB), 0);
+
+  for (int round = 0; round < 2; round++) {
+    if (round == 1) {
+      close(fd);
+    }
+
+    options.statistics = cruzdb::CreateDBStatistics();
+    ret = zlog::Log::Open("lmdb", "log", {{"path", tdir2.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    ret = cruzdb::DB::Open(options, log, false, &db);
+    ASSERT_EQ(ret, 0);
+
+    std::string val;
+    ASSERT_EQ(db->Get("a", &val), 0);
+    ASSERT_EQ(val, tdir2.path);
+
+    const auto hits = options.statistics->getTickerCount(
+        cruzdb::AFTER_IMAGE_FILE_CACHE_HIT);
+    if (round == 0) {
+      ASSERT_EQ(hits, 0u);
+    } else {
+      ASSERT_GT(hits, 0u);
+    }
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, ReOpenCheckpoint) {
+  TempDir tdir;
+
+  cruzdb::Options options;
+  options.checkpoint_interval = 5;
+  // checkpoints hold part of the committed intention index
+  options.checkpoint_index_size = 2;
+
+  std::map<std::string, std::string> prev_db;
+  for (int round = 0; round < 3; round++) {
+    zlog::Log *log;
+    int ret;
+    if (round == 0) {
+      ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    } else {
+      ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    }
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, round == 0, &db);
+    ASSERT_EQ(ret, 0);
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    for (int i = 0; i < 50; i++) {
+      auto *txn = db->BeginTransaction();
+      const std::string key = tostr(round * 100 + i);
+      const std::string val = tostr(i);
+      txn->Put(key, val);
+      prev_db[key] = val;
+      txn->Commit();
+      delete txn;
+    }
+
+    // conflict detection uses the restored committed intention index
+    auto txn1 = db->BeginTransaction();
+    auto txn2 = db->BeginTransaction();
+    txn1->Put("conflict", "a");
+    txn2->Put("conflict", "b");
+    ASSERT_TRUE(txn1->Commit());
+    ASSERT_FALSE(txn2->Commit());
+    prev_db["conflict"] = "a";
+    delete txn1;
+    delete txn2;
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, ReOpenRecovery) {
+  TempDir tdir;
+
+  // frequent checkpoints leave intentions with after images to roll forward
+  cruzdb::Options options;
+  options.checkpoint_interval = 1;
+  options.recovery_threads = 4;
+
+  std::map<std::string, std::string> prev_db;
+  for (int round = 0; round < 4; round++) {
+    options.statistics = cruzdb::CreateDBStatistics();
+
+    zlog::Log *log;
+    int ret;
+    if (round == 0) {
+      ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    } else {
+      ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    }
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, round == 0, &db);
+    ASSERT_EQ(ret, 0);
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    for (int i = 0; i < 30; i++) {
+      auto *txn = db->BeginTransaction();
+      const std::string key = tostr(round * 100 + i);
+      const std::string val = tostr(i);
+      txn->Put(key, val);
+      prev_db[key] = val;
+      txn->Commit();
+      delete txn;
+    }
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, Follower) {
+  TempDir tdir;
+
+  std::vector<std::string> keys;
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::Options options;
+    options.follower = true;
+
+    // a follower can't initialize a database
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(ret, -EINVAL);
+
+    options.follower = false;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(ret, 0);
+
+    for (int i = 0; i < 100; i++) {
+      auto *txn = db->BeginTransaction();
+      const std::string key = tostr(i);
+      txn->Put(key, key);
+      keys.push_back(key);
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+    }
+
+    delete db;
+    delete log;
+  }
+
+  zlog::Log *log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  uint64_t tail;
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::Options options;
+  options.follower = true;
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  ASSERT_EQ(db->BeginTransaction(), nullptr);
+
+  // the follower serves the state of the newest after image, which may not
+  // include the last few transactions if their after images weren't written
+  // before the writer closed.
+  // the state must be the writer's state after some prefix of its commits.
+  auto curr_db = get_map(db, db->GetSnapshot(), true, 0);
+  ASSERT_FALSE(curr_db.empty());
+  ASSERT_LE(curr_db.size(), keys.size());
+  std::map<std::string, std::string> prefix_db;
+  for (size_t i = 0; i < curr_db.size(); i++) {
+    prefix_db[keys[i]] = keys[i];
+  }
+  ASSERT_EQ(curr_db, prefix_db);
+
+  std::string val;
+  ASSERT_EQ(db->Get(keys[0], &val), 0);
+  ASSERT_EQ(val, keys[0]);
+
+  // but it can run read-only transactions
+  cruzdb::TransactionOptions read_only;
+  read_only.read_only = true;
+  auto txn = db->BeginTransaction(read_only);
+  ASSERT_NE(txn, nullptr);
+  ASSERT_EQ(txn->Get(keys[0], &val), 0);
+  ASSERT_EQ(val, keys[0]);
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  delete db;
+
+  // the follower didn't write to the log
+  uint64_t tail2;
+  ret = log->CheckTail(&tail2);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tail, tail2);
+
+  delete log;
+}
+
+TEST(DB, TailReadWindow) {
+  TempDir tdir;
+
+  // a window smaller than the number of readers keeps most readers waiting
+  // on positions that haven't been claimed yet.
+  cruzdb::Options options;
+  options.tail_read_threads = 8;
+  options.tail_read_window = 3;
+
+  std::map<std::string, std::string> prev_db;
+  for (int round = 0; round < 2; round++) {
+    zlog::Log *log;
+    int ret;
+    if (round == 0) {
+      ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    } else {
+      ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    }
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, round == 0, &db);
+    ASSERT_EQ(ret, 0);
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&, t] {
+        for (int i = 0; i < 50; i++) {
+          auto *txn = db->BeginTransaction();
+          const std::string key = tostr(round * 1000 + t * 100 + i);
+          txn->Put(key, key);
+          if (txn->Commit()) {
+            std::lock_guard<std::mutex> lk(lock);
+            prev_db[key] = key;
+          }
+          delete txn;
+        }
+      });
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, SmallEntryCache) {
+  TempDir tdir;
+
+  // a cache much smaller than the working set keeps replacing ring slots
+  // while readers and writers are running.
+  cruzdb::Options options;
+  options.entry_cache_size = 5;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  std::map<std::string, std::string> prev_db;
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 50; i++) {
+        auto *txn = db->BeginTransaction();
+        const std::string key = tostr(t * 100 + i);
+        std::string val;
+        txn->Get(tostr(t * 100 + i / 2), &val);
+        txn->Put(key, key);
+        if (txn->Commit()) {
+          std::lock_guard<std::mutex> lk(lock);
+          prev_db[key] = key;
+        }
+        delete txn;
+      }
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, EntryCacheByteBudgets) {
+  TempDir tdir;
+
+  // the intention with the large value, and every after image that includes
+  // its node, are larger than the budgets. the intention budget holds a few
+  // dozen small intentions.
+  cruzdb::Options options;
+  options.intention_cache_bytes = 4096;
+  options.after_image_entry_cache_bytes = 4096;
+  options.node_cache_size = 1024;
+  options.precommit_conflict_check = false;
+  options.statistics = cruzdb::CreateDBStatistics();
+
+  std::map<std::string, std::string> prev_db;
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(ret, 0);
+
+    auto txn = db->BeginTransaction();
+    const std::string large(8192, 'x');
+    txn->Put("large", large);
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+    prev_db["large"] = large;
+
+    // entries cached after the oversized entries are kept, so the
+    // intentions in the conflict zone are read from the cache.
+    auto txn0 = db->BeginTransaction();
+    txn0->Put("a", "a");
+    prev_db["a"] = "a";
+
+    for (int i = 0; i < 10; i++) {
+      auto txn = db->BeginTransaction();
+      const std::string key = tostr(i);
+      txn->Put(key, key);
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+      prev_db[key] = key;
+    }
+
+    auto hits = options.statistics->getTickerCount(
+        cruzdb::LOG_READ_CACHE_HIT);
+    ASSERT_TRUE(txn0->Commit());
+    delete txn0;
+    ASSERT_GE(options.statistics->getTickerCount(
+          cruzdb::LOG_READ_CACHE_HIT) - hits, 10u);
+
+    // a conflict zone larger than the budget is partly read from the log
+    auto txn1 = db->BeginTransaction();
+    txn1->Put("b", "b");
+    prev_db["b"] = "b";
+
+    for (int i = 0; i < 200; i++) {
+      auto txn = db->BeginTransaction();
+      const std::string key = tostr(100 + i);
+      txn->Put(key, key);
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+      prev_db[key] = key;
+    }
+
+    hits = options.statistics->getTickerCount(cruzdb::LOG_READ_CACHE_HIT);
+    ASSERT_TRUE(txn1->Commit());
+    delete txn1;
+    const auto zone_hits = options.statistics->getTickerCount(
+        cruzdb::LOG_READ_CACHE_HIT) - hits;
+    ASSERT_GT(zone_hits, 0u);
+    ASSERT_LT(zone_hits, 200u);
+
+    delete db;
+    delete log;
+  }
+
+  for (int round = 0; round < 2; round++) {
+    zlog::Log *log;
+    int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, false, &db);
+    ASSERT_EQ(ret, 0);
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&, t] {
+        for (int i = 0; i < 25; i++) {
+          auto *txn = db->BeginTransaction();
+          const std::string key = tostr(round * 1000 + t * 100 + i);
+          std::string val;
+          txn->Get(tostr(round * 1000 + i), &val);
+          txn->Put(key, key);
+          if (txn->Commit()) {
+            std::lock_guard<std::mutex> lk(lock);
+            prev_db[key] = key;
+          }
+          delete txn;
+        }
+      });
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    ASSERT_EQ(prev_db, get_map(db, db->GetSnapshot(), true, 0));
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, ReOpenTreeUnchangedOrEmpty) {
+  TempDir tdir;
+
+  // without catalog entries an intention can leave the tree unchanged or
+  // empty, and its after image must still restore the right tree.
+  cruzdb::Options options;
+  options.committed_intention_index_size = 1;
+
+  for (int round = 0; round < 3; round++) {
+    zlog::Log *log;
+    int ret;
+    if (round == 0) {
+      ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    } else {
+      ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    }
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, round == 0, &db);
+    ASSERT_EQ(ret, 0);
+
+    std::map<std::string, std::string> expected;
+    if (round == 1) {
+      expected["a"] = "a";
+    }
+    ASSERT_EQ(expected, get_map(db, db->GetSnapshot(), true, 0));
+
+    switch (round) {
+      case 0:
+        {
+          auto txn = db->BeginTransaction();
+          txn->Put("a", "a");
+          ASSERT_TRUE(txn->Commit());
+          delete txn;
+
+          // read-only
+          std::string val;
+          txn = db->BeginTransaction();
+          ASSERT_EQ(txn->Get("a", &val), 0);
+          ASSERT_TRUE(txn->Commit());
+          delete txn;
+        }
+        break;
+
+      case 1:
+        {
+          // the old snapshot's conflict zone is found through backpointers
+          auto txn0 = db->BeginTransaction();
+          for (int i = 0; i < 5; i++) {
+            std::string val;
+            auto txn = db->BeginTransaction();
+            txn->Get("a", &val);
+            ASSERT_TRUE(txn->Commit());
+            delete txn;
+          }
+          txn0->Delete("a");
+          ASSERT_TRUE(txn0->Commit());
+          delete txn0;
+        }
+        break;
+    }
+
+    delete db;
+    delete log;
+  }
+}
+
+TEST(DB, SnapshotRegistry) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.node_cache_size = 4096;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  ASSERT_EQ(db->GetSnapshotStats().num_snapshots, 0u);
+
+  auto txn = db->BeginTransaction();
+  txn->Put("a", "a");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  auto snap0 = db->GetSnapshot();
+  auto stats = db->GetSnapshotStats();
+  ASSERT_EQ(stats.num_snapshots, 1u);
+  const auto pos0 = stats.oldest_position;
+
+  txn = db->BeginTransaction();
+  txn->Put("b", "b");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  // iterators and read-only transactions hold their own snapshots
+  auto it = db->NewIterator();
+  cruzdb::TransactionOptions read_only;
+  read_only.read_only = true;
+  auto ro = db->BeginTransaction(read_only);
+
+  stats = db->GetSnapshotStats();
+  ASSERT_EQ(stats.num_snapshots, 3u);
+  ASSERT_EQ(stats.oldest_position, pos0);
+
+  db->ReleaseSnapshot(snap0);
+  stats = db->GetSnapshotStats();
+  ASSERT_EQ(stats.num_snapshots, 2u);
+  ASSERT_GT(stats.oldest_position, pos0);
+
+  size_t count = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    count++;
+  }
+  ASSERT_EQ(count, 2u);
+
+  delete it;
+  ASSERT_TRUE(ro->Commit());
+  delete ro;
+  ASSERT_EQ(db->GetSnapshotStats().num_snapshots, 0u);
+
+  // an iterator keeps the nodes on its path in memory after the node cache
+  // evicts them
+  txn = db->BeginTransaction();
+  for (int i = 0; i < 500; i++) {
+    txn->Put(tostr(i), std::string(100, 'x'));
+  }
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  it = db->NewIterator();
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid());
+
+  std::string val;
+  while (db->GetSnapshotStats().pinned_bytes == 0) {
+    for (int i = 0; i < 500; i++) {
+      ASSERT_EQ(db->Get(tostr(i), &val), 0);
+    }
+  }
+
+  delete it;
+  ASSERT_EQ(db->GetSnapshotStats().pinned_bytes, 0u);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, SnapshotAt) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  // older committed states are found by scanning the log
+  options.committed_intention_index_size = 2;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  // a follower installs each of the commits below
+  cruzdb::Options follower_options;
+  follower_options.follower = true;
+  cruzdb::DB *follower;
+  ret = cruzdb::DB::Open(follower_options, log, false, &follower);
+  ASSERT_EQ(ret, 0);
+
+  // the log tail before and after each commit
+  std::vector<uint64_t> starts;
+  std::vector<uint64_t> tails;
+  for (int i = 0; i < 10; i++) {
+    uint64_t start;
+    ret = log->CheckTail(&start);
+    ASSERT_EQ(ret, 0);
+    starts.push_back(start);
+
+    auto txn = db->BeginTransaction();
+    txn->Put("a", std::to_string(i));
+    txn->Put("k" + std::to_string(i), "");
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+
+    uint64_t tail;
+    ret = log->CheckTail(&tail);
+    ASSERT_EQ(ret, 0);
+    tails.push_back(tail);
+  }
+
+  auto check = [&](cruzdb::DB *db) {
+    ASSERT_EQ(db->GetSnapshotAt(0), nullptr);
+
+    for (int i = 0; i < 10; i++) {
+      auto snapshot = db->GetSnapshotAt(tails[i] - 1);
+      ASSERT_NE(snapshot, nullptr);
+
+      std::string val;
+      auto it = db->NewIterator(snapshot);
+      it->Seek("a");
+      ASSERT_TRUE(it->Valid());
+      ASSERT_EQ(it->value().ToString(), std::to_string(i));
+
+      size_t count = 0;
+      for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        count++;
+      }
+      ASSERT_EQ(count, (size_t)i + 2);
+      delete it;
+
+      db->ReleaseSnapshot(snapshot);
+    }
+  };
+
+  check(db);
+
+  // the last after image is written in the background
+  ASSERT_TRUE(follower->WaitForPosition(starts.back(),
+        std::chrono::seconds(30)));
+  delete db;
+  check(follower);
+  delete follower;
+
+  // nothing is cached after reopening the database
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+  check(db);
+  ASSERT_EQ(db->GetSnapshotStats().num_snapshots, 0u);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, WaitForPosition) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn = db->BeginTransaction();
+  txn->Put("a", "a");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  uint64_t tail;
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+
+  // positions up to the committed intention have been processed
+  ASSERT_TRUE(db->WaitForPosition(1, std::chrono::microseconds(0)));
+  ASSERT_TRUE(db->WaitForPosition(tail - 2, std::chrono::microseconds(0)));
+
+  // nothing is appended
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(db->WaitForPosition(tail + 100,
+        std::chrono::milliseconds(50)));
+  ASSERT_GE(std::chrono::steady_clock::now() - start,
+      std::chrono::milliseconds(50));
+
+  // a waiter is woken by the next commit, which is appended at or after the
+  // current tail
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+  bool woken = false;
+  std::thread waiter([&] {
+    woken = db->WaitForPosition(tail, std::chrono::seconds(30));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  txn = db->BeginTransaction();
+  txn->Put("b", "b");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  waiter.join();
+  ASSERT_TRUE(woken);
+
+  delete db;
+  delete log;
+}
+
 TEST(Txn, WriteWriteConflict) {
   TempDir tdir;
 
@@ -417,22 +1402,790 @@ TEST(Txn, WriteWriteConflict) {
   ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
 
-  // note this txn+commit causes the next two transactions created to have
-  // snapshots > 0. the initialization case is handled below in the *SnapInit
-  // variants.
+  // note this txn+commit causes the next two transactions created to have
+  // snapshots > 0. the initialization case is handled below in the *SnapInit
+  // variants.
+  auto txn0 = db->BeginTransaction();
+  txn0->Put("foo", "foo");
+  txn0->Commit();
+
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  // TODO: assert snapshot property
+
+  txn1->Put("bar", "bar");
+  txn2->Put("bar", "baz");
+
+  ASSERT_TRUE(txn1->Commit());
+  ASSERT_FALSE(txn2->Commit());
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, RangeReadConflict) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn0 = db->BeginTransaction();
+  txn0->Put("a", "a");
+  txn0->Put("c", "c");
+  txn0->Put("e", "e");
+  ASSERT_TRUE(txn0->Commit());
+
+  // scans [b, e] and then inserts an unrelated key so it isn't read-only
+  auto scan = [](cruzdb::Transaction *txn) {
+    auto it = txn->NewIterator();
+    std::vector<std::string> keys;
+    for (it->Seek("b"); it->Valid(); it->Next()) {
+      keys.push_back(it->key().ToString());
+      if (it->key().ToString() >= "d")
+        break;
+    }
+    delete it;
+    txn->Put("x", "x");
+    return keys;
+  };
+
+  // an insert into the scanned range aborts the scan
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  ASSERT_EQ(scan(txn1), (std::vector<std::string>{"c", "e"}));
+  txn2->Put("d", "d");
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_FALSE(txn1->Commit());
+
+  // so does deleting a key that was visited
+  txn1 = db->BeginTransaction();
+  txn2 = db->BeginTransaction();
+  ASSERT_EQ(scan(txn1), (std::vector<std::string>{"c", "d"}));
+  txn2->Delete("c");
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_FALSE(txn1->Commit());
+
+  // updates outside of the range do not conflict
+  txn1 = db->BeginTransaction();
+  txn2 = db->BeginTransaction();
+  ASSERT_EQ(scan(txn1), (std::vector<std::string>{"d"}));
+  txn2->Put("a", "b");
+  txn2->Put("f", "f");
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_TRUE(txn1->Commit());
+
+  // a scan that runs off the end covers every key after it
+  txn1 = db->BeginTransaction();
+  txn2 = db->BeginTransaction();
+  auto it = txn1->NewIterator();
+  for (it->Seek("f"); it->Valid(); it->Next())
+    ;
+  delete it;
+  txn1->Put("b", "b");
+  txn2->Put("zz", "zz");
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_FALSE(txn1->Commit());
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, SnapshotIsolation) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn0 = db->BeginTransaction();
+  txn0->Put("a", "a");
+  txn0->Put("b", "b");
+  ASSERT_TRUE(txn0->Commit());
+
+  cruzdb::TransactionOptions si;
+  si.isolation = cruzdb::kSnapshotIsolation;
+
+  // reads of a key that is concurrently updated abort a serializable
+  // transaction, but not one running under snapshot isolation.
+  for (auto isolation : {cruzdb::kSerializable, cruzdb::kSnapshotIsolation}) {
+    cruzdb::TransactionOptions txn_options;
+    txn_options.isolation = isolation;
+    auto txn1 = db->BeginTransaction(txn_options);
+    auto txn2 = db->BeginTransaction();
+
+    std::string val;
+    ASSERT_EQ(txn1->Get("a", &val), 0);
+    auto it = txn1->NewIterator();
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+      ;
+    delete it;
+    txn1->Put("c", val);
+
+    txn2->Put("a", "x");
+    txn2->Put("d", "x");
+    ASSERT_TRUE(txn2->Commit());
+    ASSERT_EQ(txn1->Commit(), isolation == cruzdb::kSnapshotIsolation);
+  }
+
+  // write-write conflicts still abort
+  auto txn1 = db->BeginTransaction(si);
+  auto txn2 = db->BeginTransaction(si);
+  txn1->Put("b", "1");
+  txn2->Put("b", "2");
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_FALSE(txn1->Commit());
+
+  // the snapshot isolation transaction read the first update of "a"
+  std::string val;
+  ASSERT_EQ(db->Get("c", &val), 0);
+  ASSERT_EQ(val, "x");
+  ASSERT_EQ(db->Get("b", &val), 0);
+  ASSERT_EQ(val, "2");
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, MeldConcurrentCommits) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = cruzdb::CreateDBStatistics();
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  std::map<std::string, std::string> truth;
+
+  auto txn = db->BeginTransaction();
+  for (int i = 0; i < 1000; i++) {
+    auto key = std::to_string(10000 + i);
+    txn->Put(key, key);
+    truth[key] = key;
+  }
+  ASSERT_TRUE(txn->Commit());
+
+  // the second transaction of each pair commits after the first, on top of
+  // a snapshot that doesn't include it. updates to keys far apart in the
+  // tree touch disjoint nodes and can be melded.
+  std::mt19937 gen(0);
+  for (int i = 0; i < 100; i++) {
+    auto txn1 = db->BeginTransaction();
+    auto txn2 = db->BeginTransaction();
+
+    auto key1 = std::to_string(10000 + gen() % 500);
+    auto key2 = std::to_string(10500 + gen() % 500);
+    auto val = std::to_string(i);
+    txn1->Put(key1, val);
+    if (i % 3) {
+      txn2->Put(key2, val);
+      truth[key2] = val;
+    } else {
+      txn2->Delete(key2);
+      truth.erase(key2);
+    }
+    truth[key1] = val;
+
+    ASSERT_TRUE(txn1->Commit());
+    ASSERT_TRUE(txn2->Commit());
+  }
+
+  ASSERT_GT(options.statistics->getTickerCount(
+        cruzdb::TXN_INTENTIONS_MELDED), 0u);
+
+  auto check = [&](cruzdb::DB *db) {
+    auto it = db->NewIterator();
+    auto it2 = truth.begin();
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      ASSERT_NE(it2, truth.end());
+      ASSERT_EQ(it->key().ToString(), it2->first);
+      ASSERT_EQ(it->value().ToString(), it2->second);
+      it2++;
+    }
+    ASSERT_EQ(it2, truth.end());
+    delete it;
+  };
+
+  check(db);
+  delete db;
+
+  // nodes are read back from the after images written for melded trees
+  options.meld_intentions = false;
+  options.node_cache_size = 1024;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+  check(db);
+
+  delete db;
+  delete log;
+}
+
+// a melded tree must be exactly the tree that replaying its intention
+// produces. the same transactions are run with and without melding, and the
+// after images are compared byte for byte. each commit waits for the
+// checkpoint written once its after image is finalized, so both logs have the
+// same layout and every tree is built on nodes with after image addresses.
+TEST(Txn, MeldMatchesReplay) {
+  auto run = [](bool meld, zlog::Log *log, std::vector<uint64_t>& after_images,
+      uint64_t *melded) {
+    cruzdb::DB *db;
+    cruzdb::Options options;
+    options.statistics = cruzdb::CreateDBStatistics();
+    options.meld_intentions = meld;
+    options.checkpoint_interval = 1;
+    int ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(ret, 0);
+
+    auto commit = [&](cruzdb::Transaction *txn) {
+      uint64_t tail;
+      ASSERT_EQ(log->CheckTail(&tail), 0);
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+
+      // the intention, its after image and a checkpoint
+      uint64_t tail2;
+      while (true) {
+        ASSERT_EQ(log->CheckTail(&tail2), 0);
+        if (tail2 == tail + 3)
+          break;
+        ASSERT_LT(tail2, tail + 3);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      after_images.push_back(tail + 1);
+    };
+
+    auto txn = db->BeginTransaction();
+    for (int i = 0; i < 1000; i++) {
+      auto key = std::to_string(10000 + i);
+      txn->Put(key, key);
+    }
+    commit(txn);
+
+    std::mt19937 gen(0);
+    for (int i = 0; i < 50; i++) {
+      auto txn1 = db->BeginTransaction();
+      auto txn2 = db->BeginTransaction();
+
+      // txn1 also changes the values of the even keys in the upper half,
+      // which include nodes on the path that txn2 copied.
+      auto key1 = std::to_string(10000 + gen() % 500);
+      auto key2 = std::to_string(10501 + 2 * (gen() % 249));
+      auto val = std::to_string(i);
+      txn1->Put(key1, val);
+      for (int j = 10500; j < 11000; j += 2) {
+        txn1->Put(std::to_string(j), val);
+      }
+      if (i % 3) {
+        txn2->Put(key2, val);
+      } else {
+        txn2->Delete(key2);
+      }
+      if (i % 5 == 0) {
+        txn2->Put(std::to_string(20000 + i), val);
+      }
+
+      commit(txn1);
+      commit(txn2);
+    }
+
+    *melded = options.statistics->getTickerCount(
+        cruzdb::TXN_INTENTIONS_MELDED);
+
+    delete db;
+  };
+
+  TempDir tdir;
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  TempDir tdir2;
+  zlog::Log *log2;
+  ret = zlog::Log::Create("lmdb", "log", {{"path", tdir2.path}}, "", "", &log2);
+  ASSERT_EQ(ret, 0);
+
+  std::vector<uint64_t> after_images;
+  uint64_t melded;
+  run(true, log, after_images, &melded);
+  ASSERT_GT(melded, 0u);
+
+  std::vector<uint64_t> after_images2;
+  uint64_t melded2;
+  run(false, log2, after_images2, &melded2);
+  ASSERT_EQ(melded2, 0u);
+
+  ASSERT_EQ(after_images, after_images2);
+  for (auto pos : after_images) {
+    std::string data, data2;
+    ASSERT_EQ(log->Read(pos, &data), 0);
+    ASSERT_EQ(log2->Read(pos, &data2), 0);
+    ASSERT_TRUE(data == data2) << "after image at " << pos;
+  }
+
+  delete log;
+  delete log2;
+}
+
+TEST(Txn, MergeCounters) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.merge_operator = cruzdb::CreateUInt64AddOperator();
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  std::string one;
+  cruzdb::PutFixed64(&one, 1);
+
+  // concurrent merges into the same key all commit
+  std::vector<cruzdb::Transaction*> txns;
+  for (int i = 0; i < 10; i++) {
+    txns.push_back(db->BeginTransaction());
+  }
+  for (auto txn : txns) {
+    txn->Merge("counter", one);
+    txn->Merge("counter", one);
+  }
+  for (auto txn : txns) {
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  std::string val;
+  ASSERT_EQ(db->Get("counter", &val), 0);
+  ASSERT_EQ(cruzdb::DecodeFixed64(val.data()), 20u);
+
+  // reading the counter makes the transaction conflict with merges
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  ASSERT_EQ(txn1->Get("counter", &val), 0);
+  txn1->Put("copy", val);
+  txn2->Merge("counter", one);
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_FALSE(txn1->Commit());
+  delete txn1;
+  delete txn2;
+
+  // a merge reads its own transaction's earlier writes
+  auto txn = db->BeginTransaction();
+  txn->Merge("other", one);
+  txn->Merge("other", one);
+  ASSERT_EQ(txn->Get("other", &val), 0);
+  ASSERT_EQ(cruzdb::DecodeFixed64(val.data()), 2u);
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  delete db;
+
+  // merges are replayed on open
+  options.meld_intentions = false;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  ASSERT_EQ(db->Get("counter", &val), 0);
+  ASSERT_EQ(cruzdb::DecodeFixed64(val.data()), 21u);
+  ASSERT_EQ(db->Get("other", &val), 0);
+  ASSERT_EQ(cruzdb::DecodeFixed64(val.data()), 2u);
+  ASSERT_EQ(db->Get("copy", &val), -ENOENT);
+
+  // after images are written in the background, and a merge without one is
+  // replayed on open. a follower sees a commit once its after image, and
+  // those written before it, are in the log.
+  uint64_t tail;
+  ASSERT_EQ(log->CheckTail(&tail), 0);
+  txn = db->BeginTransaction();
+  txn->Put("sync", "x");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  cruzdb::Options follower_options;
+  follower_options.follower = true;
+  cruzdb::DB *follower;
+  ret = cruzdb::DB::Open(follower_options, log, false, &follower);
+  ASSERT_EQ(ret, 0);
+  ASSERT_TRUE(follower->WaitForPosition(tail, std::chrono::seconds(30)));
+  delete follower;
+
+  delete db;
+
+  // merges already in after images don't need an operator, but new merges
+  // fail and leave the transaction unchanged
+  cruzdb::Options no_merge;
+  ret = cruzdb::DB::Open(no_merge, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  txn = db->BeginTransaction();
+  ASSERT_EQ(txn->Merge("counter", one), -EINVAL);
+  txn->Put("after", "x");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  ASSERT_EQ(db->Get("counter", &val), 0);
+  ASSERT_EQ(cruzdb::DecodeFixed64(val.data()), 21u);
+
+  delete db;
+
+  // an intention with merges at the end of the log is rolled forward on open.
+  // this one aborts, but that isn't known before it is processed.
+  options.precommit_conflict_check = false;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  txn1 = db->BeginTransaction();
+  txn2 = db->BeginTransaction();
+  ASSERT_EQ(txn1->Get("after", &val), 0);
+  ASSERT_EQ(txn1->Merge("counter", one), 0);
+  txn2->Put("after", "y");
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_FALSE(txn1->Commit());
+  delete txn1;
+  delete txn2;
+
+  delete db;
+
+  ret = cruzdb::DB::Open(no_merge, log, false, &db);
+  ASSERT_EQ(ret, -EINVAL);
+
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(db->Get("counter", &val), 0);
+  ASSERT_EQ(cruzdb::DecodeFixed64(val.data()), 21u);
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, ExecuteRetry) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = cruzdb::CreateDBStatistics();
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  // a transaction that is certain to abort never reaches the log. the after
+  // image of txn2 is appended in the background, so the log is checked once
+  // it has been written.
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  txn2->Put("a", "b");
+  uint64_t tail;
+  ASSERT_EQ(log->CheckTail(&tail), 0);
+  ASSERT_TRUE(txn2->Commit());
+  uint64_t tail2;
+  while (true) {
+    ASSERT_EQ(log->CheckTail(&tail2), 0);
+    if (tail2 == tail + 2)
+      break;
+    ASSERT_LT(tail2, tail + 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::string val;
+  ASSERT_EQ(txn1->Get("a", &val), -ENOENT);
+  txn1->Put("b", "b");
+  ASSERT_FALSE(txn1->Commit());
+  ASSERT_EQ(options.statistics->getTickerCount(
+        cruzdb::TXN_ABORTED_BEFORE_APPEND), 1u);
+  ASSERT_EQ(log->CheckTail(&tail), 0);
+  ASSERT_EQ(tail, tail2);
+  delete txn1;
+  delete txn2;
+
+  // concurrent increments of a counter all commit after retrying
+  cruzdb::RetryPolicy retry;
+  retry.max_attempts = 0;
+
+  const int num_threads = 4;
+  const int num_increments = 20;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&] {
+      for (int j = 0; j < num_increments; j++) {
+        int ret = db->Execute([](cruzdb::Transaction *txn) {
+          std::string val;
+          int count = 0;
+          if (txn->Get("counter", &val) == 0) {
+            count = std::stoi(val);
+          }
+          txn->Put("counter", tostr(count + 1));
+          return true;
+        }, retry);
+        ASSERT_EQ(ret, 0);
+      }
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(db->Get("counter", &val), 0);
+  ASSERT_EQ(std::stoi(val), num_threads * num_increments);
+
+  // the closure can give up
+  ret = db->Execute([](cruzdb::Transaction *txn) {
+    txn->Put("counter", "0");
+    return false;
+  });
+  ASSERT_EQ(ret, -ECANCELED);
+  ASSERT_EQ(db->Get("counter", &val), 0);
+  ASSERT_EQ(std::stoi(val), num_threads * num_increments);
+
+  // an attempt limit is reported once every attempt aborts
+  retry.max_attempts = 2;
+  int attempts = 0;
+  ret = db->Execute([&](cruzdb::Transaction *txn) {
+    attempts++;
+    std::string val;
+    txn->Get("counter", &val);
+    auto other = db->BeginTransaction();
+    other->Put("counter", "0");
+    EXPECT_TRUE(other->Commit());
+    delete other;
+    txn->Put("other", "x");
+    return true;
+  }, retry);
+  ASSERT_EQ(ret, -EBUSY);
+  ASSERT_EQ(attempts, 2);
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, CommitAsync) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  // many transactions in flight from a single thread. every other
+  // transaction writes the same key, so all but the first of those abort.
+  const int num_txns = 200;
+  std::mutex lock;
+  std::condition_variable cond;
+  int completed = 0;
+  int committed = 0;
+  for (int i = 0; i < num_txns; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(i % 2 ? "shared" : tostr(i), tostr(i));
+    txn->CommitAsync([&](bool result) {
+      std::lock_guard<std::mutex> lk(lock);
+      completed++;
+      if (result) {
+        committed++;
+      }
+      cond.notify_one();
+    });
+    delete txn;
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    cond.wait(lk, [&] { return completed == num_txns; });
+  }
+  ASSERT_GE(committed, num_txns / 2 + 1);
+  ASSERT_LT(committed, num_txns);
+
+  std::string val;
+  for (int i = 0; i < num_txns; i += 2) {
+    ASSERT_EQ(db->Get(tostr(i), &val), 0);
+    ASSERT_EQ(val, tostr(i));
+  }
+
+  // the future returned for a conflicting transaction reports the abort
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  txn1->Put("x", "1");
+  txn2->Put("x", "2");
+  auto f2 = txn2->CommitAsync();
+  ASSERT_TRUE(f2.get());
+  auto f1 = txn1->CommitAsync();
+  ASSERT_FALSE(f1.get());
+  delete txn1;
+  delete txn2;
+
+  // read-only transactions complete immediately
+  auto txn = db->BeginTransaction();
+  ASSERT_EQ(txn->Get("x", &val), 0);
+  ASSERT_TRUE(txn->CommitAsync().get());
+  delete txn;
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, ReadOnly) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn0 = db->BeginTransaction();
+  txn0->Put("a", "a");
+  txn0->Put("b", "b");
+  ASSERT_TRUE(txn0->Commit());
+  delete txn0;
+
+  cruzdb::TransactionOptions read_only;
+  read_only.read_only = true;
+  auto txn1 = db->BeginTransaction(read_only);
+
+  // the read-only transaction keeps reading its snapshot
+  auto txn2 = db->BeginTransaction();
+  txn2->Put("a", "x");
+  txn2->Delete("b");
+  txn2->Put("c", "c");
+  ASSERT_TRUE(txn2->Commit());
+  delete txn2;
+
+  std::string val;
+  ASSERT_EQ(txn1->Get("a", &val), 0);
+  ASSERT_EQ(val, "a");
+  ASSERT_EQ(txn1->Get("c", &val), -ENOENT);
+
+  std::vector<std::string> keys;
+  auto it = txn1->NewIterator();
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    keys.push_back(it->key().ToString());
+  }
+  delete it;
+  ASSERT_EQ(keys, std::vector<std::string>({"a", "b"}));
+
+  // it commits even though keys that it read were changed
+  ASSERT_TRUE(txn1->Commit());
+  delete txn1;
+
+  auto txn3 = db->BeginTransaction(read_only);
+  ASSERT_EQ(txn3->Get("a", &val), 0);
+  ASSERT_EQ(val, "x");
+  ASSERT_TRUE(txn3->CommitAsync().get());
+  delete txn3;
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, ConflictZoneReadFromLog) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  // intentions in the conflict zone are evicted and read back from the log,
+  // with more reads than are allowed in flight at once.
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.entry_cache_size = 1;
+  options.intention_read_parallelism = 3;
+  options.precommit_conflict_check = false;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
   auto txn0 = db->BeginTransaction();
   txn0->Put("foo", "foo");
   txn0->Commit();
 
   auto txn1 = db->BeginTransaction();
   auto txn2 = db->BeginTransaction();
-  // TODO: assert snapshot property
 
-  txn1->Put("bar", "bar");
-  txn2->Put("bar", "baz");
+  for (int i = 0; i < 20; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
 
-  ASSERT_TRUE(txn1->Commit());
-  ASSERT_FALSE(txn2->Commit());
+  txn1->Put(tostr(7), "bar");
+  txn2->Put("bar", "bar");
+
+  ASSERT_FALSE(txn1->Commit());
+  ASSERT_TRUE(txn2->Commit());
+
+  delete txn0;
+  delete txn1;
+  delete txn2;
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, ConflictZoneOutsideIndex) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  // the conflict zone starts before the oldest indexed intention, so the
+  // rest of it is found in the catalog.
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.committed_intention_index_size = 4;
+  options.precommit_conflict_check = false;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn0 = db->BeginTransaction();
+  txn0->Put("foo", "foo");
+  txn0->Commit();
+
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+
+  for (int i = 0; i < 20; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  txn1->Put(tostr(2), "bar");
+  txn2->Put("foo", "bar");
+
+  ASSERT_FALSE(txn1->Commit());
+  ASSERT_TRUE(txn2->Commit());
+
+  delete txn0;
+  delete txn1;
+  delete txn2;
 
   delete db;
   delete log;
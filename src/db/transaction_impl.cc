@@ -13,12 +13,14 @@ namespace cruzdb {
 
   // root intention unsigned?
 TransactionImpl::TransactionImpl(DBImpl *db, NodePtr root,
-    uint64_t snapshot, int64_t rid, uint64_t token) :
+    uint64_t snapshot, int64_t rid, uint64_t token,
+    const TransactionOptions& options) :
   db_(db),
   token_(token),
   tree_(std::make_unique<PersistentTree>(db_, root, rid)),
   intention_(std::make_unique<Intention>(snapshot, token_)),
-  committed_(false)
+  committed_(false),
+  track_reads_(options.isolation == kSerializable)
 {
   assert(tree_);
   assert(tree_->rid() < 0);
@@ -34,7 +36,9 @@ int TransactionImpl::Get(const zlog::Slice& key, std::string *value)
   assert(intention_);
   assert(!committed_);
 
-  intention_->Get(key);
+  if (track_reads_) {
+    intention_->Get(key);
+  }
   return tree_->Get(PREFIX_USER, key, value);
 }
 
@@ -53,6 +57,33 @@ void TransactionImpl::Delete(const zlog::Slice& key)
   tree_->Delete(PREFIX_USER, key);
 }
 
+int TransactionImpl::Merge(const zlog::Slice& key, const zlog::Slice& operand)
+{
+  assert(tree_);
+  assert(intention_);
+  assert(!committed_);
+
+  // the merged value is visible to the transaction, but it isn't a read of
+  // the key since the operand is applied again when the intention is replayed.
+  const int ret = db_->MergeValue(tree_.get(), key, operand);
+  if (ret) {
+    return ret;
+  }
+
+  intention_->Merge(key, operand);
+  return 0;
+}
+
+Iterator *TransactionImpl::NewIterator()
+{
+  assert(tree_);
+  assert(intention_);
+  assert(!committed_);
+
+  return new TransactionIterator(db_, tree_->View(),
+      track_reads_ ? intention_.get() : nullptr);
+}
+
 bool TransactionImpl::Commit()
 {
   assert(tree_);
@@ -66,6 +97,164 @@ bool TransactionImpl::Commit()
   return db_->CompleteTransaction(this);
 }
 
+void TransactionImpl::CommitAsync(std::function<void(bool)> callback)
+{
+  assert(tree_);
+  assert(!committed_);
+  committed_ = true;
+
+  if (tree_->ReadOnly()) {
+    callback(true);
+    return;
+  }
+
+  db_->CompleteTransactionAsync(this, std::move(callback));
+}
+
+ReadOnlyTransaction::ReadOnlyTransaction(DBImpl *db, Snapshot *snapshot) :
+  db_(db),
+  snapshot_(snapshot),
+  committed_(false)
+{
+}
+
+ReadOnlyTransaction::~ReadOnlyTransaction()
+{
+  db_->ReleaseSnapshot(snapshot_);
+}
+
+int ReadOnlyTransaction::Get(const zlog::Slice& key, std::string *value)
+{
+  assert(!committed_);
+  return db_->Get(snapshot_->root, key, value);
+}
+
+void ReadOnlyTransaction::Put(const zlog::Slice& key,
+    const zlog::Slice& value)
+{
+  write_error();
+}
+
+void ReadOnlyTransaction::Delete(const zlog::Slice& key)
+{
+  write_error();
+}
+
+int ReadOnlyTransaction::Merge(const zlog::Slice& key,
+    const zlog::Slice& operand)
+{
+  write_error();
+  return -EINVAL;
+}
+
+Iterator *ReadOnlyTransaction::NewIterator()
+{
+  assert(!committed_);
+  return new FilteredPrefixIteratorImpl(PREFIX_USER, snapshot_);
+}
+
+bool ReadOnlyTransaction::Commit()
+{
+  assert(!committed_);
+  committed_ = true;
+  return true;
+}
+
+void ReadOnlyTransaction::CommitAsync(std::function<void(bool)> callback)
+{
+  assert(!committed_);
+  committed_ = true;
+  callback(true);
+}
+
+void ReadOnlyTransaction::write_error() const
+{
+  std::cerr << "write in a read-only transaction" << std::endl;
+  assert(0);
+  exit(1);
+}
+
+TransactionIterator::TransactionIterator(DBImpl *db, NodePtr root,
+    Intention *intention) :
+  snapshot_(db, root),
+  iter_(PREFIX_USER, &snapshot_),
+  intention_(intention)
+{
+}
+
+void TransactionIterator::SeekToFirst()
+{
+  iter_.SeekToFirst();
+  begin_.clear();
+  if (iter_.Valid()) {
+    end_ = iter_.key().ToString();
+  } else {
+    end_ = boost::none;
+  }
+  record();
+}
+
+void TransactionIterator::SeekToLast()
+{
+  iter_.SeekToLast();
+  if (iter_.Valid()) {
+    begin_ = iter_.key().ToString();
+  } else {
+    begin_.clear();
+  }
+  end_ = boost::none;
+  record();
+}
+
+void TransactionIterator::Seek(const zlog::Slice& target)
+{
+  iter_.Seek(target);
+  begin_ = target.ToString();
+  if (iter_.Valid()) {
+    end_ = iter_.key().ToString();
+  } else {
+    end_ = boost::none;
+  }
+  record();
+}
+
+// moving past either end of the tree reads everything beyond the last key
+// visited, which is what makes the scan sensitive to concurrent inserts.
+void TransactionIterator::Next()
+{
+  iter_.Next();
+  if (!iter_.Valid()) {
+    end_ = boost::none;
+  } else if (end_) {
+    auto key = iter_.key().ToString();
+    if (key > *end_) {
+      end_ = std::move(key);
+    }
+  }
+  record();
+}
+
+void TransactionIterator::Prev()
+{
+  iter_.Prev();
+  if (!iter_.Valid()) {
+    begin_.clear();
+  } else {
+    auto key = iter_.key().ToString();
+    if (key < begin_) {
+      begin_ = std::move(key);
+    }
+  }
+  record();
+}
+
+void TransactionIterator::record()
+{
+  if (intention_) {
+    intention_->ReadRange(begin_, end_);
+  }
+}
+
 void TransactionImpl::Put(const std::string& prefix, const zlog::Slice& key,
     const zlog::Slice& value)
 {
@@ -1,17 +1,84 @@
 #pragma once
+#include "cruzdb/options.h"
 #include "cruzdb/transaction.h"
 #include "db/node.h"
 #include "db/persistent_tree.h"
 #include "db/intention.h"
+#include "db/iterator_impl.h"
+#include "db/snapshot.h"
 
 namespace cruzdb {
 
 class DBImpl;
 
+// iterates over the user keys of a transaction's tree, and adds each range of
+// keys that it visits to the transaction's read set.
+class TransactionIterator : public Iterator {
+ public:
+  // visited ranges are not recorded when intention is null
+  TransactionIterator(DBImpl *db, NodePtr root, Intention *intention);
+
+  bool Valid() const override {
+    return iter_.Valid();
+  }
+
+  void SeekToFirst() override;
+  void SeekToLast() override;
+  void Seek(const zlog::Slice& target) override;
+  void Next() override;
+  void Prev() override;
+
+  zlog::Slice key() const override {
+    return iter_.key();
+  }
+
+  zlog::Slice value() const override {
+    return iter_.value();
+  }
+
+ private:
+  void record();
+
+  Snapshot snapshot_;
+  FilteredPrefixIteratorImpl iter_;
+  Intention *intention_;
+
+  // the range visited since the last seek
+  std::string begin_;
+  boost::optional<std::string> end_;
+};
+
+// a transaction that only reads from its snapshot. it has no tree or
+// intention of its own, so it needs nothing from the transaction processor.
+class ReadOnlyTransaction : public Transaction {
+ public:
+  // takes ownership of the snapshot
+  ReadOnlyTransaction(DBImpl *db, Snapshot *snapshot);
+
+  ~ReadOnlyTransaction();
+
+  virtual int Get(const zlog::Slice& key, std::string *value) override;
+  virtual void Put(const zlog::Slice& key, const zlog::Slice& value) override;
+  virtual void Delete(const zlog::Slice& key) override;
+  virtual int Merge(const zlog::Slice& key,
+      const zlog::Slice& operand) override;
+  virtual Iterator *NewIterator() override;
+  virtual bool Commit() override;
+  using Transaction::CommitAsync;
+  virtual void CommitAsync(std::function<void(bool)> callback) override;
+
+ private:
+  void write_error() const;
+
+  DBImpl *db_;
+  Snapshot *snapshot_;
+  bool committed_;
+};
+
 class TransactionImpl : public Transaction {
  public:
   TransactionImpl(DBImpl *db, NodePtr root, uint64_t snapshot,
-      int64_t rid, uint64_t token);
+      int64_t rid, uint64_t token, const TransactionOptions& options);
 
   ~TransactionImpl();
 
@@ -20,7 +87,12 @@ class TransactionImpl : public Transaction {
   virtual int Get(const zlog::Slice& key, std::string *value) override;
   virtual void Put(const zlog::Slice& key, const zlog::Slice& value) override;
   virtual void Delete(const zlog::Slice& key) override;
+  virtual int Merge(const zlog::Slice& key,
+      const zlog::Slice& operand) override;
+  virtual Iterator *NewIterator() override;
   virtual bool Commit() override;
+  using Transaction::CommitAsync;
+  virtual void CommitAsync(std::function<void(bool)> callback) override;
 
   // internal api
  public:
@@ -36,6 +108,10 @@ class TransactionImpl : public Transaction {
     return std::move(intention_);
   }
 
+  void TrackTreeReads() {
+    tree_->TrackReads();
+  }
+
   std::unique_ptr<PersistentTree> Tree() {
     return std::move(tree_);
   }
@@ -46,6 +122,10 @@ class TransactionImpl : public Transaction {
   std::unique_ptr<PersistentTree> tree_;
   std::unique_ptr<Intention> intention_;
   bool committed_;
+
+  // reads are left out of the intention under snapshot isolation, which
+  // limits conflicts to write-write conflicts.
+  const bool track_reads_;
 };
 
 }
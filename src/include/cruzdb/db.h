@@ -1,4 +1,6 @@
 #pragma once
+#include <chrono>
+#include <functional>
 #include <vector>
 #include <memory>
 #include <zlog/log.h>
@@ -16,6 +18,21 @@ class Snapshot;
 class Iterator;
 class Transaction;
 
+// live snapshots, including those held by iterators and read-only
+// transactions.
+struct SnapshotStats {
+  size_t num_snapshots = 0;
+  // the position of the oldest committed state that is being read
+  uint64_t oldest_position = 0;
+  // how long the longest held snapshot has been held
+  std::chrono::milliseconds oldest_age{0};
+  // snapshots only hold weak references to tree nodes, but an iterator holds
+  // the nodes on its current path, and a transaction those it has read. this
+  // is the size of the nodes evicted from the node cache that are still held
+  // that way, which is memory outside of the cache budget.
+  size_t pinned_bytes = 0;
+};
+
 class DB {
  public:
   DB() {}
@@ -32,9 +49,28 @@ class DB {
       std::shared_ptr<spdlog::logger> logger);
 
   /*
+   * Returns nullptr if the database was opened as a follower, unless the
+   * transaction is read-only.
+   */
+  virtual Transaction *BeginTransaction(const TransactionOptions& options) = 0;
+
+  Transaction *BeginTransaction() {
+    return BeginTransaction(TransactionOptions());
+  }
+
+  /*
+   * Run fn in a new transaction and commit it. If the transaction aborts, fn
+   * is run again in a transaction on a newer snapshot after a randomized
+   * exponential backoff. Returning false from fn abandons the transaction
+   * without committing it.
    *
+   * Returns 0 when the transaction commits, -ECANCELED if fn returned false,
+   * -EBUSY if every attempt aborted, and -EINVAL if the transaction could not
+   * be started.
    */
-  virtual Transaction *BeginTransaction() = 0;
+  int Execute(const std::function<bool(Transaction*)>& fn,
+      const RetryPolicy& policy = RetryPolicy(),
+      const TransactionOptions& options = TransactionOptions());
 
   /*
    *
@@ -51,14 +87,42 @@ class DB {
    */
   virtual Iterator *NewIterator(Snapshot *snapshot) = 0;
 
-  Iterator *NewIterator() {
-    return NewIterator(GetSnapshot());
-  }
+  /*
+   * Get a snapshot of the database as of the newest transaction committed at
+   * or before the log position pos. Nodes of older snapshots are read from the
+   * log as they are accessed. If pos is newer than the processed state, the
+   * log is read up to pos and the call waits for the intentions in it to be
+   * processed. Returns nullptr if nothing was committed at or before pos, if
+   * pos is at or past the log tail, or on a follower if an intention at or
+   * before pos hasn't been installed yet. The snapshot is released with
+   * ReleaseSnapshot.
+   */
+  virtual Snapshot *GetSnapshotAt(uint64_t pos) = 0;
+
+  /*
+   * Iterate over the latest committed database snapshot. The snapshot is
+   * released when the iterator is deleted.
+   */
+  virtual Iterator *NewIterator() = 0;
+
+  /*
+   * Report on the snapshots that are currently held.
+   */
+  virtual SnapshotStats GetSnapshotStats() = 0;
 
   /*
    * Lookup a key in the latest committed database snapshot.
    */
   virtual int Get(const zlog::Slice& key, std::string *value) = 0;
+
+  /*
+   * Wait until the intention at log position pos, and every intention before
+   * it, has been processed, so that the latest snapshot reflects them.
+   * Returns false if the timeout expires first. If pos isn't an intention the
+   * wait ends when a newer intention has been processed.
+   */
+  virtual bool WaitForPosition(uint64_t pos,
+      std::chrono::microseconds timeout) = 0;
 };
 
 }
@@ -0,0 +1,33 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <zlog/slice.h>
+
+namespace cruzdb {
+
+// A merge operator combines an operand written with Transaction::Merge into
+// the current value of a key. Merges are applied when an intention is
+// replayed against the latest committed state rather than when the
+// transaction runs, so concurrent merges into the same key do not conflict.
+//
+// Every instance that processes the log must be configured with the same
+// operator, and an operator must be deterministic.
+class MergeOperator {
+ public:
+  virtual ~MergeOperator() {}
+
+  // Set new_value to the result of applying operand to existing_value, which
+  // is nullptr if the key does not exist. Returning false fails the
+  // Transaction::Merge call, and is a fatal error when a merge is replayed.
+  virtual bool Merge(const zlog::Slice& key,
+      const zlog::Slice *existing_value, const zlog::Slice& operand,
+      std::string *new_value) const = 0;
+
+  virtual const char *Name() const = 0;
+};
+
+// Adds operands to values, both encoded as fixed 64-bit little-endian
+// unsigned integers. A missing or malformed value counts as zero.
+std::shared_ptr<MergeOperator> CreateUInt64AddOperator();
+
+}
@@ -1,15 +1,145 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <string>
 
 namespace cruzdb {
 
+class MergeOperator;
 class Statistics;
 
+// compression applied to log entries. a codec that was not available when the
+// library was built is treated as kNoCompression when writing, and it is a
+// fatal error to read an entry that was written with it.
+enum CompressionType : unsigned char {
+  kNoCompression = 0x0,
+  kLZ4Compression = 0x1,
+  kZSTDCompression = 0x2,
+};
+
+// isolation level of a transaction. serializable transactions abort if a
+// key they read or a range they scanned was written by a transaction that
+// committed after their snapshot. under snapshot isolation only concurrent
+// writes to the same key abort a transaction, and reads are not logged.
+enum IsolationLevel : unsigned char {
+  kSerializable = 0x0,
+  kSnapshotIsolation = 0x1,
+};
+
+struct TransactionOptions {
+  IsolationLevel isolation = kSerializable;
+
+  // a read-only transaction reads from its snapshot without building an
+  // intention or recording its reads, and always commits. writing in a
+  // read-only transaction is a fatal error.
+  bool read_only = false;
+};
+
+// controls how DB::Execute retries a transaction that aborts. the delay before
+// each retry is chosen uniformly at random up to a backoff that starts at
+// initial_backoff_us and doubles after every abort, up to max_backoff_us.
+struct RetryPolicy {
+  // total number of attempts. zero retries until the transaction commits.
+  size_t max_attempts = 10;
+  uint64_t initial_backoff_us = 100;
+  uint64_t max_backoff_us = 100000;
+};
+
 struct Options {
   std::shared_ptr<Statistics> statistics = nullptr;
   size_t node_cache_size = 512*1024*1024;
   size_t imap_cache_size = 100000;
+
+  // recently read log entries are cached in two position indexed caches, one
+  // for intentions and one for after images, each with entry_cache_size
+  // slots. intentions are kept for conflict checking until the byte budget
+  // is exceeded, oldest first, while after images are dropped as soon as
+  // their nodes are in the node cache. entries larger than a budget aren't
+  // cached. the intention budget should cover the intentions committed
+  // during a typical transaction.
   size_t entry_cache_size = 1000;
+  size_t intention_cache_bytes = 64ULL << 20;
+  size_t after_image_entry_cache_bytes = 64ULL << 20;
+
+  // after images are always compressed when compression is enabled, but
+  // intentions are only compressed when they are at least this large. entries
+  // that do not shrink are always written uncompressed.
+  CompressionType compression = kNoCompression;
+  size_t compression_min_intention_size = 4096;
+
+  // write after images in a flat binary format that is read in place rather
+  // than parsed into protobuf messages. after images in either format are
+  // always readable.
+  bool flat_after_images = true;
+
+  // path of a local memory mapped file that caches after images read from
+  // the log so they survive a restart. the cache is disabled when no path is
+  // set. a cache file holds the after images of one log at a time, and is
+  // reinitialized when it is opened with a different log.
+  std::string after_image_cache_path;
+  size_t after_image_cache_size = 1ULL << 30;
+
+  // write a checkpoint to the log after this many after images have been
+  // finalized. on open the newest checkpoint restores the database state and
+  // its in-memory indexes without scanning and replaying the log. zero
+  // disables checkpoints.
+  size_t checkpoint_interval = 1000;
+
+  // the most committed intention positions, and separately intention to after
+  // image mappings, saved in a checkpoint. this bounds the size of each
+  // checkpoint. positions older than those saved are found in the log.
+  size_t checkpoint_index_size = 1000;
+
+  // number of threads used on open to scan the log that will be rolled
+  // forward for after images that can be reused instead of replaying their
+  // intentions. zero disables the scan.
+  size_t recovery_threads = 4;
+
+  // open the database as a read-only follower. a follower tails after images
+  // written by other instances and installs them as its latest state instead
+  // of processing intentions. it never writes to the log, and snapshots may
+  // trail the log until the after images of newer intentions are written.
+  bool follower = false;
+
+  // the log tail is read by a pool of threads that read and parse up to
+  // tail_read_window positions ahead of the newest entry made visible to
+  // readers. entries are still made visible in log order.
+  size_t tail_read_threads = 4;
+  size_t tail_read_window = 64;
+
+  // maximum number of concurrent log reads issued when fetching the
+  // intentions in a transaction's conflict zone.
+  size_t intention_read_parallelism = 32;
+
+  // number of recent committed intention positions kept in memory to find
+  // the intentions in a transaction's conflict zone. older conflict zones are
+  // found by scanning the database catalog.
+  size_t committed_intention_index_size = 100000;
+
+  // applies operands written with Transaction::Merge. required to commit or
+  // replay a merge, and DB::Open fails if an intention that will be rolled
+  // forward contains merges and no operator is set.
+  std::shared_ptr<MergeOperator> merge_operator = nullptr;
+
+  // a local transaction that commits after other intentions were committed
+  // since its snapshot reuses the tree it built rather than replaying its
+  // intention against the latest tree, as long as none of the nodes it read
+  // were changed by the newer intentions.
+  bool meld_intentions = true;
+
+  // before appending a transaction's intention, check it against intentions
+  // that have already committed after its snapshot. a transaction that is
+  // certain to abort then aborts without writing to the log.
+  bool precommit_conflict_check = true;
+
+  // snapshots hold weak references to tree nodes, so an old snapshot doesn't
+  // keep its nodes in memory, but reading it fetches them from the log and
+  // cycles them through the node cache. snapshots held longer than this many
+  // seconds are reported in the log, as are evicted nodes that iterators and
+  // transactions still hold once they exceed the node cache size. zero
+  // disables the report.
+  size_t snapshot_warning_age = 600;
 };
 
 }
@@ -19,6 +19,17 @@ enum Tickers : uint32_t {
   NODE_CACHE_FREE,
   BYTES_WRITTEN,
   BYTES_READ,
+  BYTES_COMPRESSED,
+  BYTES_UNCOMPRESSED,
+  BYTES_DECOMPRESSED,
+  AFTER_IMAGE_FILE_CACHE_HIT,
+  AFTER_IMAGE_FILE_CACHE_MISS,
+  RECOVERY_AFTER_IMAGES_REUSED,
+  TXN_INTENTIONS_MELDED,
+  TXN_INTENTIONS_MELD_FAILED,
+  TXN_ABORTED_BEFORE_APPEND,
+  NODE_CACHE_FREE_PINNED,
+  NODE_CACHE_FREE_PINNED_BYTES,
   TICKER_ENUM_MAX
 };
 
@@ -34,6 +45,17 @@ const std::vector<std::pair<Tickers, std::string>> TickersNameMap = {
   {NODE_CACHE_FREE, "cruzdb.node_cache.free"},
   {BYTES_WRITTEN, "cruzdb.bytes.written"},
   {BYTES_READ, "cruzdb.bytes.read"},
+  {BYTES_COMPRESSED, "cruzdb.bytes.compressed"},
+  {BYTES_UNCOMPRESSED, "cruzdb.bytes.uncompressed"},
+  {BYTES_DECOMPRESSED, "cruzdb.bytes.decompressed"},
+  {AFTER_IMAGE_FILE_CACHE_HIT, "cruzdb.after_image_file_cache.hit"},
+  {AFTER_IMAGE_FILE_CACHE_MISS, "cruzdb.after_image_file_cache.miss"},
+  {RECOVERY_AFTER_IMAGES_REUSED, "cruzdb.recovery.after_images_reused"},
+  {TXN_INTENTIONS_MELDED, "cruzdb.txn.intentions_melded"},
+  {TXN_INTENTIONS_MELD_FAILED, "cruzdb.txn.intentions_meld_failed"},
+  {TXN_ABORTED_BEFORE_APPEND, "cruzdb.txn.aborted_before_append"},
+  {NODE_CACHE_FREE_PINNED, "cruzdb.node_cache.free.pinned"},
+  {NODE_CACHE_FREE_PINNED_BYTES, "cruzdb.node_cache.free.pinned_bytes"},
 };
 
 enum Histograms : uint32_t {
@@ -1,6 +1,10 @@
 #pragma once
+#include <functional>
+#include <future>
+#include <memory>
 #include <string>
 #include <zlog/slice.h>
+#include "cruzdb/iterator.h"
 
 namespace cruzdb {
 
@@ -16,7 +20,39 @@ class Transaction {
   virtual void Put(const zlog::Slice& key, const zlog::Slice& value) = 0;
   virtual void Delete(const zlog::Slice& key) = 0;
 
+  // Apply a merge operand to the value of a key using the database's merge
+  // operator. The operand is applied again to the latest value of the key
+  // when the transaction commits, so a merge does not conflict with other
+  // transactions that write the key. A transaction that reads the key still
+  // conflicts with concurrent merges. Returns -EINVAL, leaving the transaction
+  // unchanged, if the database has no merge operator or the operator fails.
+  virtual int Merge(const zlog::Slice& key, const zlog::Slice& operand) = 0;
+
+  // Returns an iterator over the transaction's snapshot and its own updates
+  // made before the iterator was created. In a serializable transaction the
+  // key ranges visited by the iterator are added to the read set, so the
+  // transaction aborts if a concurrent transaction commits a key in a scanned
+  // range. The iterator must be deleted before the transaction, and must not
+  // be used after the transaction is updated or committed.
+  virtual Iterator *NewIterator() = 0;
+
   virtual bool Commit() = 0;
+
+  // Commit without blocking the calling thread. The callback receives the
+  // commit decision, and is invoked on the database's transaction processing
+  // thread, so it should hand off any real work rather than block. It may
+  // also be invoked before CommitAsync returns. The transaction may be
+  // deleted once CommitAsync returns.
+  virtual void CommitAsync(std::function<void(bool)> callback) = 0;
+
+  std::future<bool> CommitAsync() {
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto future = promise->get_future();
+    CommitAsync([promise](bool committed) {
+      promise->set_value(committed);
+    });
+    return future;
+  }
 };
 
 }
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace cruzdb {
+
+// fixed width little-endian encoding
+
+inline void EncodeFixed16(char *buf, uint16_t value)
+{
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+}
+
+inline void EncodeFixed32(char *buf, uint32_t value)
+{
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  buf[2] = (value >> 16) & 0xff;
+  buf[3] = (value >> 24) & 0xff;
+}
+
+inline void EncodeFixed64(char *buf, uint64_t value)
+{
+  EncodeFixed32(buf, value & 0xffffffff);
+  EncodeFixed32(buf + 4, value >> 32);
+}
+
+inline uint16_t DecodeFixed16(const char *ptr)
+{
+  const auto *p = reinterpret_cast<const unsigned char*>(ptr);
+  return static_cast<uint16_t>(p[0]) |
+    (static_cast<uint16_t>(p[1]) << 8);
+}
+
+inline uint32_t DecodeFixed32(const char *ptr)
+{
+  const auto *p = reinterpret_cast<const unsigned char*>(ptr);
+  return static_cast<uint32_t>(p[0]) |
+    (static_cast<uint32_t>(p[1]) << 8) |
+    (static_cast<uint32_t>(p[2]) << 16) |
+    (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline uint64_t DecodeFixed64(const char *ptr)
+{
+  return static_cast<uint64_t>(DecodeFixed32(ptr)) |
+    (static_cast<uint64_t>(DecodeFixed32(ptr + 4)) << 32);
+}
+
+inline void PutFixed16(std::string *dst, uint16_t value)
+{
+  char buf[sizeof(value)];
+  EncodeFixed16(buf, value);
+  dst->append(buf, sizeof(buf));
+}
+
+inline void PutFixed32(std::string *dst, uint32_t value)
+{
+  char buf[sizeof(value)];
+  EncodeFixed32(buf, value);
+  dst->append(buf, sizeof(buf));
+}
+
+inline void PutFixed64(std::string *dst, uint64_t value)
+{
+  char buf[sizeof(value)];
+  EncodeFixed64(buf, value);
+  dst->append(buf, sizeof(buf));
+}
+
+// fixed width big-endian encoding. unlike the little-endian encoding, the
+// encoded values sort in numeric order when compared as byte strings.
+
+inline void PutBigEndian64(std::string *dst, uint64_t value)
+{
+  char buf[sizeof(value)];
+  for (int i = 7; i >= 0; i--) {
+    buf[i] = value & 0xff;
+    value >>= 8;
+  }
+  dst->append(buf, sizeof(buf));
+}
+
+inline uint64_t DecodeBigEndian64(const char *ptr)
+{
+  const auto *p = reinterpret_cast<const unsigned char*>(ptr);
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+}
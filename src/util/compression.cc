@@ -0,0 +1,112 @@
+#include "util/compression.h"
+#include <limits>
+#ifdef CRUZDB_LZ4
+#include <lz4.h>
+#endif
+#ifdef CRUZDB_ZSTD
+#include <zstd.h>
+#endif
+
+namespace cruzdb {
+
+bool CompressionTypeSupported(CompressionType type)
+{
+  switch (type) {
+    case kNoCompression:
+      return true;
+    case kLZ4Compression:
+#ifdef CRUZDB_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case kZSTDCompression:
+#ifdef CRUZDB_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+bool Compress(CompressionType type, const zlog::Slice& input,
+    std::string *output)
+{
+  switch (type) {
+    case kNoCompression:
+      output->assign(input.data(), input.size());
+      return true;
+
+#ifdef CRUZDB_LZ4
+    case kLZ4Compression:
+      {
+        if (input.size() > (size_t)std::numeric_limits<int>::max())
+          return false;
+        const int bound = LZ4_compressBound(input.size());
+        output->resize(bound);
+        const int size = LZ4_compress_default(input.data(), &(*output)[0],
+            input.size(), bound);
+        if (size <= 0)
+          return false;
+        output->resize(size);
+        return true;
+      }
+#endif
+
+#ifdef CRUZDB_ZSTD
+    case kZSTDCompression:
+      {
+        const size_t bound = ZSTD_compressBound(input.size());
+        output->resize(bound);
+        const size_t size = ZSTD_compress(&(*output)[0], bound,
+            input.data(), input.size(), 1);
+        if (ZSTD_isError(size))
+          return false;
+        output->resize(size);
+        return true;
+      }
+#endif
+
+    default:
+      return false;
+  }
+}
+
+bool Uncompress(CompressionType type, const zlog::Slice& input,
+    size_t uncompressed_size, std::string *output)
+{
+  switch (type) {
+    case kNoCompression:
+      output->assign(input.data(), input.size());
+      return input.size() == uncompressed_size;
+
+#ifdef CRUZDB_LZ4
+    case kLZ4Compression:
+      {
+        if (uncompressed_size > (size_t)std::numeric_limits<int>::max())
+          return false;
+        output->resize(uncompressed_size);
+        const int size = LZ4_decompress_safe(input.data(), &(*output)[0],
+            input.size(), uncompressed_size);
+        return size >= 0 && (size_t)size == uncompressed_size;
+      }
+#endif
+
+#ifdef CRUZDB_ZSTD
+    case kZSTDCompression:
+      {
+        output->resize(uncompressed_size);
+        const size_t size = ZSTD_decompress(&(*output)[0], uncompressed_size,
+            input.data(), input.size());
+        return !ZSTD_isError(size) && size == uncompressed_size;
+      }
+#endif
+
+    default:
+      return false;
+  }
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <string>
+#include <zlog/slice.h>
+#include "cruzdb/options.h"
+
+namespace cruzdb {
+
+// true if the codec was available when the library was built
+bool CompressionTypeSupported(CompressionType type);
+
+// compress input into output. false is returned if the codec is not supported
+// or compression failed, in which case the contents of output are undefined.
+bool Compress(CompressionType type, const zlog::Slice& input,
+    std::string *output);
+
+// decompress input into output. uncompressed_size is the exact size of the
+// original input and is recorded along side the compressed data.
+bool Uncompress(CompressionType type, const zlog::Slice& input,
+    size_t uncompressed_size, std::string *output);
+
+}
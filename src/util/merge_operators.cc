@@ -0,0 +1,38 @@
+#include "cruzdb/merge_operator.h"
+#include "util/coding.h"
+
+namespace cruzdb {
+
+namespace {
+
+class UInt64AddOperator : public MergeOperator {
+ public:
+  bool Merge(const zlog::Slice& key, const zlog::Slice *existing_value,
+      const zlog::Slice& operand, std::string *new_value) const override {
+    const uint64_t sum = decode(existing_value) + decode(&operand);
+    new_value->clear();
+    PutFixed64(new_value, sum);
+    return true;
+  }
+
+  const char *Name() const override {
+    return "UInt64AddOperator";
+  }
+
+ private:
+  static uint64_t decode(const zlog::Slice *value) {
+    if (value == nullptr || value->size() != sizeof(uint64_t)) {
+      return 0;
+    }
+    return DecodeFixed64(value->data());
+  }
+};
+
+}
+
+std::shared_ptr<MergeOperator> CreateUInt64AddOperator()
+{
+  return std::make_shared<UInt64AddOperator>();
+}
+
+}